@@ -5,41 +5,79 @@
 // - Fill missing shot time by linear interpolation between nearest anchors
 // - Optional filename-override rule when fs times drift too far from filename timestamp
 // - Write EXIF shot time if missing + sync filesystem times
+// - Batch mode (command line) and a persistent anchor index for O(log n) queries of new files
 //
 // Build (Windows + vcpkg integrate):
 //   - Set C++ Language Standard: /std:c++17
 //   - Install exiv2 via vcpkg, platform match x64
 //
 // Build (Linux):
-//   g++ -std=c++17 photo_timefix.cpp -lexiv2 -o photo_timefix
+//   g++ -std=c++17 photo_timefix.cpp -lexiv2 -pthread -o photo_timefix
 
 #include <exiv2/exiv2.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cctype>
+#include <cerrno>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
+#include <functional>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #ifdef _WIN32
 #define NOMINMAX
 #include <windows.h>
+#include <intrin.h>
+#include <shellapi.h>
+#include <psapi.h>
 #else
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#endif
 
 namespace fs = std::filesystem;
 
+// per-file report lines (ReportWriter)
+enum class ReportFormat : uint8_t {
+    None,
+    Human,
+    Jsonl,
+    Csv
+};
+
 struct Options {
     bool recursive = true;
     bool dryRun = true;
@@ -52,34 +90,578 @@ struct Options {
 
     bool oneSideStep = true;                     // 只有单侧锚点时，为避免同秒重复，按1秒递增/递减
     long long oneSideStepSeconds = 1;
+    bool sequentialDedup = false;                // dedup by +1s bumps after the previous target instead of nearest free second
 
     bool writeExifIfMissing = true;              // 只对缺失拍摄时间的文件写 EXIF
+    bool exifInPlace = true;                     // add the dates in place when the file layout allows, else Exiv2 rewrites the file
+    bool reflinkRewrite = true;                  // Linux: write EXIF to a reflink clone and swap it in atomically
+    bool reflinkBackup = false;                  // keep the swapped-out original as "<file>.orig" (shares its blocks)
+    bool xmpSidecar = false;                     // write the dates to "<file>.xmp" instead of the file (videos too); read them back as shot
     bool syncFileTimes = true;                   // 同步文件系统时间到目标时间（Windows含创建时间）
+    bool dropPageCache = false;                  // drop what metadata reads bring into the page cache (batch mode: on)
 
     bool verbose = true;
+    ReportFormat reportFormat = ReportFormat::Human; // batch mode: None unless --report is given
+    fs::path reportPath;                         // empty = standard output
+    bool progress = false;                       // live status line on stderr (batch mode: when stderr is a terminal)
+    double progressJsonEvery = 0;                // JSON progress line on stderr every N seconds (0 = off)
+    fs::path statsPath;                          // --stats: per-stage times and counters as JSON
+    size_t slowestFiles = 10;                    // --stats: the N slowest files with their read and apply time
+    fs::path tracePath;                          // --trace: per-thread spans as Chrome trace JSON
+
+    size_t keepMetadata = 1024;                  // files whose parsed metadata is kept from read to EXIF write (0 = parse again)
+    int applyJobs = 4;                           // parallel file writes per device; spinning disks (Linux) get 1
+    std::vector<std::pair<fs::path, int>> deviceJobs; // per-device override: a path on the device -> parallel writes
+
+    int ioPriorityClass = 0;                     // 0 = unchanged, 2 = best-effort, 3 = idle (Linux ioprio classes)
+    int ioPriorityLevel = 4;                     // best-effort level 0 (highest) .. 7
+    double maxFilesPerSec = 0;                   // caps for all threads together (0 = none)
+    double maxReadBytesPerSec = 0;
+    double maxWriteBytesPerSec = 0;
+    double latencyTargetMs = 0;                  // lower the caps while files take longer (0 = fixed caps)
+
+    fs::path journalPath;                        // apply journal for --rollback (empty = off)
+    size_t journalSyncEvery = 256;               // journal records per sync
+    fs::path rollbackPath;                       // only undo the run recorded in this journal
+    fs::path planPath;                           // dry-run: write the plan here for --apply-plan (empty = off)
+    fs::path applyPlanPath;                      // only apply the plan in this file, no scan
+
+    fs::path indexPath;                          // write the anchor index here after the run (empty = off)
+    fs::path queryFile;                          // only answer "what target would this file get" from the index
+    bool indexUpdate = false;                    // with queryFile: also add the file to the index
+    bool incremental = false;                    // reuse shots and unchanged segments from the previous index
 };
 
-enum class ShotSource {
+enum class ShotSource : uint8_t {
     None,
     ExifOrXmp,
     Filename
 };
 
-struct Item {
-    fs::path path;
-    std::time_t mtime{};
+// Why a file got its target; text only when printing (reasonText). Stored in the anchor index: append only.
+enum class TargetReason : uint8_t {
+    None,
+    ShotFromMetadata,
+    ShotFromFilename,
+    FilenameOverrideFsTimes,
+    FilenameOverrideMtime,
+    GapTooLarge,
+    AnchorsTooClose,
+    Interpolated,
+    OnlyPrevSteps,
+    OnlyPrev,
+    OnlyNextSteps,
+    OnlyNext
+};
+
+// ItemTable::flags bits
+enum ItemFlag : uint8_t {
+    kUniqueBumped = 1,       // dedup moved the target (+1s steps)
+    kUniqueNearest = 2,      // dedup moved the target (nearest free second)
+    kExifWritten = 4,        // apply results, used for the anchor index
+    kFsTimesSynced = 8,
+    kTargetApplied = 16,     // file on disk is synced to target by this run
+    kXmpWritten = 32,        // dates written to the XMP sidecar (instead of EXIF)
+    kNoExifToWrite = 64,     // metadata read: EXIF not writable or all dates present (while mtime/size are as scanned)
+    kFsTimesMatched = 128,   // file times already were the target, nothing set
+};
+
+// ItemTable::missingDates bits: the EXIF dates writeExifShotIfMissing() adds that the file does not have
+enum MissingDate : uint8_t {
+    kMissingDateTimeOriginal = 1,   // Exif.Photo.DateTimeOriginal
+    kMissingDateTimeDigitized = 2,  // Exif.Photo.DateTimeDigitized
+    kMissingImageDateTime = 4,      // Exif.Image.DateTime
+    kMissingDatesKnown = 8,         // the metadata was read (else nothing is known, the bits are 0)
+};
+
+static constexpr int64_t kNoTime = INT64_MIN; // "no time" in time columns and in the anchor index
+
+// Paths of a run with every directory stored once. A file is a 4-byte directory id followed by its
+// NUL-terminated name in one string, and is referred to by the offset of that entry (up to 4 GiB of names).
+// Full paths are rebuilt on demand into a caller's buffer.
+struct PathArena {
+    static constexpr uint32_t kFull = UINT32_MAX;
+    std::string files;
+    std::vector<const std::string*> dirs;               // dir text including its trailing separator
+    std::unordered_map<std::string, uint32_t> dirIds;   // owns the dir text
+    uint32_t lastDir = UINT32_MAX;                      // files come in directory order, skip most lookups
+
+    uint32_t add(std::string_view utf8) {
 #ifdef _WIN32
-    std::optional<std::time_t> ctime{};
-    std::optional<std::time_t> wtime{};
+        const size_t cut = utf8.find_last_of("/\\") + 1;
+#else
+        const size_t cut = utf8.find_last_of('/') + 1;  // npos + 1 == 0: no directory part
 #endif
+        const std::string_view dir = utf8.substr(0, cut), name = utf8.substr(cut);
+        if (files.size() + sizeof(uint32_t) + name.size() + 1 >= kFull) return kFull;
+
+        if (lastDir == UINT32_MAX || *dirs[lastDir] != dir) {
+            auto found = dirIds.find(std::string(dir));
+            if (found == dirIds.end()) {
+                found = dirIds.emplace(std::string(dir), (uint32_t)dirs.size()).first;
+                dirs.push_back(&found->first);
+            }
+            lastDir = found->second;
+        }
 
-    std::optional<std::time_t> shot;      // 读取到的“拍摄时间” (anchor)
-    ShotSource shotSource = ShotSource::None;
+        uint32_t id = (uint32_t)files.size();
+        files.append((const char*)&lastDir, sizeof(uint32_t));
+        files.append(name);
+        files.push_back('\0');
+        return id;
+    }
+
+    uint32_t dirOf(uint32_t id) const {
+        uint32_t d;
+        std::memcpy(&d, files.data() + id, sizeof(d));
+        return d;
+    }
+    std::string_view dir(uint32_t id) const { return *dirs[dirOf(id)]; }
+    std::string_view name(uint32_t id) const { return std::string_view(files.data() + id + sizeof(uint32_t)); }
+
+    std::string_view path(uint32_t id, std::string& buf) const {
+        buf.assign(dir(id));
+        buf.append(name(id));
+        return buf;
+    }
+
+    // same order as comparing the full paths, without building them
+    int compare(uint32_t a, uint32_t b) const {
+        if (dirOf(a) == dirOf(b)) return name(a).compare(name(b));
+        return compareJoined(dir(a), name(a), dir(b), name(b));
+    }
+
+    // compares a1+a2 with b1+b2
+    static int compareJoined(std::string_view a1, std::string_view a2, std::string_view b1, std::string_view b2) {
+        for (;;) {
+            if (a1.empty()) {
+                if (a2.empty()) return (b1.empty() && b2.empty()) ? 0 : -1;
+                a1 = a2; a2 = {};
+            }
+            if (b1.empty()) {
+                if (b2.empty()) return 1;
+                b1 = b2; b2 = {};
+            }
+            const size_t n = std::min(a1.size(), b1.size());
+            if (int c = a1.substr(0, n).compare(b1.substr(0, n))) return c;
+            a1.remove_prefix(n);
+            b1.remove_prefix(n);
+        }
+    }
+};
+
+// Files of a run as struct of arrays: row i of every column is the same file, 39 bytes per file plus its name.
+// Times are seconds, kNoTime when missing.
+struct ItemTable {
+    PathArena paths;
+    std::vector<uint32_t> pathId;
+    std::vector<int64_t> mtime;
+    std::vector<uint64_t> fileSize;
+    std::vector<int64_t> shot;           // 读取到的“拍摄时间” (anchor)
+    std::vector<int64_t> target;         // 最终要写入的时间（EXIF/文件时间）
+    std::vector<ShotSource> shotSource;
+    std::vector<TargetReason> reason;
+    std::vector<uint8_t> flags;          // ItemFlag bits
+    std::vector<uint8_t> missingDates;   // MissingDate bits of the metadata read
+#ifdef _WIN32
+    std::vector<int64_t> ctime;
+    std::vector<int64_t> wtime;
+#endif
+    std::vector<int32_t> indexRecord;    // incremental runs only: record in the previous run's index, -1 if changed
+    std::vector<float> readSeconds;      // --stats only: time of the metadata read (slowest files)
+
+    template <class F>
+    void forEachColumn(F&& f) {
+        f(pathId); f(mtime); f(fileSize); f(shot); f(target); f(shotSource); f(reason); f(flags); f(missingDates);
+#ifdef _WIN32
+        f(ctime); f(wtime);
+#endif
+        f(indexRecord); f(readSeconds);
+    }
+
+    size_t size() const { return pathId.size(); }
+    bool hasShot(size_t i) const { return shot[i] != kNoTime; }
+    bool hasTarget(size_t i) const { return target[i] != kNoTime; }
+    std::string_view fileName(size_t i) const { return paths.name(pathId[i]); }
+    // full path, built in buf
+    std::string_view pathUtf8(size_t i, std::string& buf) const { return paths.path(pathId[i], buf); }
+
+    // new row with nothing known yet; false if the path arena is full
+    bool add(std::string_view pathUtf8) {
+        uint32_t id = paths.add(pathUtf8);
+        if (id == PathArena::kFull) return false;
+        pathId.push_back(id);
+        mtime.push_back(0);
+        fileSize.push_back(0);
+        shot.push_back(kNoTime);
+        target.push_back(kNoTime);
+        shotSource.push_back(ShotSource::None);
+        reason.push_back(TargetReason::None);
+        flags.push_back(0);
+        missingDates.push_back(0);
+#ifdef _WIN32
+        ctime.push_back(kNoTime);
+        wtime.push_back(kNoTime);
+#endif
+        if (!indexRecord.empty()) indexRecord.push_back(-1);
+        if (!readSeconds.empty()) readSeconds.push_back(0);
+        return true;
+    }
+
+    // row i becomes the old row order[i]
+    void permute(const std::vector<uint32_t>& order) {
+        forEachColumn([&](auto& col) {
+            if (col.empty()) return;
+            std::decay_t<decltype(col)> out(order.size());
+            for (size_t i = 0; i < order.size(); ++i) out[i] = col[order[i]];
+            col.swap(out);
+            });
+    }
+
+    // drop the growth slack left by collecting
+    void shrinkToFit() {
+        paths.files.shrink_to_fit();
+        forEachColumn([](auto& col) { col.shrink_to_fit(); });
+    }
+};
+
+// ---------- trace (--trace) ----------
+// Spans of what each thread does (stages, folders scanned, batches of files, waits on queues and throttling)
+// in a ring buffer per thread, written as Chrome trace JSON at the end (chrome://tracing, ui.perfetto.dev).
+// Off unless --trace is given; then a span costs two clock reads and a store into the thread's own buffer.
+struct TraceEvent {
+    const char* name = nullptr;      // string literal
+    const char* argName = nullptr;   // string literal, nullptr: no argument
+    uint64_t arg = 0;
+    std::string detail;              // e.g. the folder; empty: none
+    int64_t start = 0;               // ns since the trace began
+    int64_t duration = 0;
+};
+
+struct TraceThread {
+    static constexpr size_t kCapacity = 1 << 16; // events kept per thread; older ones are overwritten
+    std::vector<TraceEvent> ring;
+    uint64_t recorded = 0;
+    uint32_t id = 0;
+    std::string name;
+};
+
+struct Tracer {
+    bool on = false;                 // set before any thread starts
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceThread>> threads; // outlive their threads, read when all have ended
+
+    void enable() {
+        on = true;
+        start = std::chrono::steady_clock::now();
+    }
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    TraceThread& thisThread() {
+        thread_local TraceThread* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::make_unique<TraceThread>());
+            mine = threads.back().get();
+            mine->id = (uint32_t)threads.size();
+        }
+        return *mine;
+    }
+
+    void add(TraceEvent&& e) {
+        TraceThread& t = thisThread();
+        if (t.ring.size() < TraceThread::kCapacity) t.ring.push_back(std::move(e));
+        else t.ring[t.recorded % TraceThread::kCapacity] = std::move(e);
+        t.recorded++;
+    }
+};
+
+static Tracer& tracer() {
+    static Tracer t;
+    return t;
+}
 
-    std::optional<std::time_t> target;    // 最终要写入的时间（EXIF/文件时间）
-    std::string targetReason;
+static void traceThreadName(std::string name) {
+    if (tracer().on) tracer().thisThread().name = std::move(name);
+}
+
+// one span on the calling thread, from begin() to end() or the end of the scope
+struct TraceSpan {
+    TraceEvent event;
+    bool running = false;
+
+    TraceSpan() = default;
+    explicit TraceSpan(const char* name, const char* argName = nullptr, uint64_t arg = 0) { begin(name, argName, arg); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan() { end(); }
+
+    // ends the running span first
+    void begin(const char* name, const char* argName = nullptr, uint64_t arg = 0, std::string_view detail = {}) {
+        end();
+        if (!tracer().on) return;
+        event.name = name;
+        event.argName = argName;
+        event.arg = arg;
+        event.detail.assign(detail.data(), detail.size());
+        event.start = tracer().now();
+        running = true;
+    }
+
+    void end() {
+        if (!running) return;
+        running = false;
+        event.duration = tracer().now() - event.start;
+        tracer().add(std::move(event));
+        event = TraceEvent();
+    }
+};
+
+// waits on cv until pred holds, as a "wait" span when it has to wait at all
+template <class Pred>
+static void traceWait(std::condition_variable& cv, std::unique_lock<std::mutex>& lock, const char* name, Pred pred) {
+    if (pred()) return;
+    TraceSpan span(name);
+    cv.wait(lock, pred);
+}
+
+static constexpr size_t kReadTraceBatch = 256; // files per "read batch" span of the metadata read
+
+// ---------- run statistics (--stats) ----------
+// Per stage: wall time, calls and the bytes the process read from and wrote to storage. Per run: what the tool
+// itself does on the scan/read/apply path: system calls on files, bytes read and written through its own
+// descriptors, Exiv2 opens, caught exceptions and filename regex searches; plus heap allocations, which the
+// replaced global operator new counts for the whole process, Exiv2 and the standard library included. Counters
+// are plain thread-local integers, added to the totals when a thread ends (mergeThreadStats), so counting costs an
+// increment. They are always on; -DPHOTO_TIMEFIX_NO_STATS compiles all of it out, operator new included.
+enum StatCounter : uint8_t {
+    kStatSyscalls,
+    kStatBytesRead,
+    kStatBytesWritten,
+    kStatExiv2Opens,
+    kStatExceptions,
+    kStatRegexCalls,
+    kStatAllocations,
+    kStatCounterCount
+};
+
+enum StatStage : uint8_t {
+    kStageCollect,          // collectFiles
+    kStageReadShot,         // fillShotTime of all files
+    kStageSort,
+    kStageOverride,         // setShotAndOverrideTargets
+    kStageInterpolate,      // inferMissingByInterpolation (incremental: the changed segments)
+    kStageDedup,            // makeTargetsUnique
+    kStageApply,            // apply and report
+    kStageIndex,            // plan file and anchor index
+    kStageCount
+};
+
+static const char* const kStatCounterNames[kStatCounterCount] = {
+    "syscalls", "bytes_read", "bytes_written", "exiv2_opens", "exceptions", "regex_calls", "allocations"
+};
+static const char* const kStatStageNames[kStageCount] = {
+    "collect_files", "read_shot_time", "sort", "filename_override", "interpolate", "dedup", "apply", "index"
+};
+
+// Bytes this process has read and written so far (Linux: from/to storage, page cache hits do not count).
+static bool processIoBytes(uint64_t& readBytes, uint64_t& writtenBytes) {
+#if defined(__linux__)
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    uint64_t value = 0;
+    int found = 0;
+    while (in >> key >> value) {
+        if (key == "read_bytes:") { readBytes = value; found |= 1; }
+        else if (key == "write_bytes:") { writtenBytes = value; found |= 2; }
+    }
+    return found == 3;
+#elif defined(_WIN32)
+    IO_COUNTERS c {};
+    if (!GetProcessIoCounters(GetCurrentProcess(), &c)) return false;
+    readBytes = c.ReadTransferCount;
+    writtenBytes = c.WriteTransferCount;
+    return true;
+#else
+    (void)readBytes; (void)writtenBytes;
+    return false;
+#endif
+}
+
+#ifndef PHOTO_TIMEFIX_NO_STATS
+static thread_local uint64_t tlsStats[kStatCounterCount];  // trivial, so operator new below may use it
+
+// not inlined: GCC would see malloc() and free() of new'ed memory and warn of a mismatch
+#if defined(__GNUC__) && !defined(__clang__)
+#define STATS_NOINLINE __attribute__((noinline))
+#else
+#define STATS_NOINLINE
+#endif
+// replaces the global one, so every allocation through new in the process is counted, not only the tool's own
+STATS_NOINLINE void* operator new(std::size_t size) {
+    tlsStats[kStatAllocations]++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+STATS_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+STATS_NOINLINE void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// Hardware counters per stage (Linux): cycles, instructions, cache misses and branch misses of all threads of the
+// process, as one perf_event_open group so that they are on the PMU at the same time and the ratios hold. Opened
+// once before any thread starts (inherit: later threads count too); user space only, which the default
+// perf_event_paranoid allows. Where they cannot be opened (no permission, no PMU in a VM, not Linux) they are
+// left out of the stats with the reason.
+enum HardwareCounter : uint8_t {
+    kHwCycles,
+    kHwInstructions,
+    kHwCacheMisses,
+    kHwBranchMisses,
+    kHwCounterCount
+};
+
+static const char* const kHwCounterNames[kHwCounterCount] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+
+struct HardwareCounters {
+    int fds[kHwCounterCount] = { -1, -1, -1, -1 };
+    std::string unavailable = "not enabled";  // why there are no counts; empty while counting
+
+    void open() {
+#ifdef __linux__
+        static const uint64_t configs[kHwCounterCount] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+        for (int k = 0; k < kHwCounterCount; ++k) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[k];
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // the others join the cycles group; one the CPU lacks is just missing
+            fds[k] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, k ? fds[kHwCycles] : -1, PERF_FLAG_FD_CLOEXEC);
+            if (k == kHwCycles && fds[k] < 0) {
+                const int e = errno;
+                unavailable = e == EACCES || e == EPERM ? "not permitted (kernel.perf_event_paranoid)"
+                    : e == ENOENT || e == ENODEV || e == EOPNOTSUPP ? "no hardware counters (virtual machine?)"
+                    : e == ENOSYS ? "perf_event_open not available" : std::strerror(e);
+                return;
+            }
+        }
+        unavailable.clear();
+#else
+        unavailable = "not supported on this system";
+#endif
+    }
+
+    // counts so far, extrapolated when the kernel had to multiplex the counters; false while not counting
+    bool read(uint64_t (&out)[kHwCounterCount]) const {
+        if (!unavailable.empty()) return false;
+#ifdef __linux__
+        for (int k = 0; k < kHwCounterCount; ++k) {
+            uint64_t v[3] = {}; // value, time enabled, time running
+            out[k] = 0;
+            if (fds[k] < 0 || ::read(fds[k], v, sizeof(v)) != (ssize_t)sizeof(v) || v[2] == 0) continue;
+            out[k] = v[2] < v[1] ? (uint64_t)((double)v[0] * (double)v[1] / (double)v[2]) : v[0];
+        }
+        return true;
+#else
+        (void)out;
+        return false;
+#endif
+    }
+};
+
+static HardwareCounters& hardwareCounters() {
+    static HardwareCounters counters;
+    return counters;
+}
+
+// --stats: before the first thread starts
+static void enableHardwareCounters() { hardwareCounters().open(); }
+
+struct RunStats {
+    std::mutex mutex;
+    uint64_t counters[kStatCounterCount] = {};
+    double seconds[kStageCount] = {};
+    uint64_t calls[kStageCount] = {};
+    uint64_t storageRead[kStageCount] = {};
+    uint64_t storageWritten[kStageCount] = {};
+    uint64_t hardware[kStageCount][kHwCounterCount] = {};
+};
+
+static RunStats& runStats() {
+    static RunStats stats;
+    return stats;
+}
+
+// adds this thread's counters to the totals; threads call it last, main before the totals are written
+static void mergeThreadStats() {
+    RunStats& s = runStats();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    for (size_t k = 0; k < kStatCounterCount; ++k) {
+        s.counters[k] += tlsStats[k];
+        tlsStats[k] = 0;
+    }
+}
+
+// one call of a stage, from construction to stop() or the end of the scope; also a trace span
+struct StageTimer {
+    StatStage stage;
+    TraceSpan span;
+    std::chrono::steady_clock::time_point start;
+    uint64_t read0 = 0, written0 = 0;
+    uint64_t hardware0[kHwCounterCount] = {};
+    bool io, hardware, running = true;
+
+    explicit StageTimer(StatStage stage_) : stage(stage_), span(kStatStageNames[stage_]),
+        start(std::chrono::steady_clock::now()), io(processIoBytes(read0, written0)),
+        hardware(hardwareCounters().read(hardware0)) {}
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+    ~StageTimer() { stop(); }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        span.end();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t r = 0, w = 0, hw[kHwCounterCount] = {};
+        const bool ioNow = io && processIoBytes(r, w);
+        const bool hardwareNow = hardware && hardwareCounters().read(hw);
+        RunStats& s = runStats();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.seconds[stage] += seconds;
+        s.calls[stage]++;
+        if (ioNow) {
+            s.storageRead[stage] += r - read0;
+            s.storageWritten[stage] += w - written0;
+        }
+        if (hardwareNow) {
+            for (int k = 0; k < kHwCounterCount; ++k) s.hardware[stage][k] += hw[k] >= hardware0[k] ? hw[k] - hardware0[k] : 0;
+        }
+    }
+};
+
+#define STAT_ADD(counter, n) (tlsStats[counter] += (uint64_t)(n))
+#else
+static void mergeThreadStats() {}
+static void enableHardwareCounters() {}
+
+struct StageTimer {
+    TraceSpan span;
+
+    explicit StageTimer(StatStage stage) : span(kStatStageNames[stage]) {}
+    void stop() { span.end(); }
 };
 
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
 // ---------- string utils ----------
 static std::string trim(std::string s) {
     while (!s.empty() && std::isspace((unsigned char)s.front())) s.erase(s.begin());
@@ -208,13 +790,32 @@ static std::string wideToUtf8(const std::wstring& ws) {
 static std::string pathToUtf8(const fs::path& p) {
     return wideToUtf8(p.wstring());
 }
+
+static fs::path pathFromUtf8(const std::string& s) {
+    return fs::path(utf8ToWide(s));
+}
 #else
 static std::string pathToUtf8(const fs::path& p) {
     // On non-Windows, filesystem path is typically UTF-8 already
     return p.u8string();
 }
+
+static fs::path pathFromUtf8(const std::string& s) {
+    return fs::path(s);
+}
 #endif
 
+// path of a table row (buf: reused for the UTF-8 text)
+static fs::path itemPath(const ItemTable& items, size_t i, std::string& buf) {
+    items.pathUtf8(i, buf);
+    return pathFromUtf8(buf);
+}
+
+static fs::path itemPath(const ItemTable& items, size_t i) {
+    std::string buf;
+    return itemPath(items, i, buf);
+}
+
 // ---------- filename timestamp parsing ----------
 static std::optional<std::time_t> parseFilenameTime(const fs::path& file) {
     // Support patterns like:
@@ -230,6 +831,7 @@ static std::optional<std::time_t> parseFilenameTime(const fs::path& file) {
 
     for (const auto& re : patterns) {
         std::smatch m;
+        STAT_ADD(kStatRegexCalls, 1);
         if (std::regex_search(name, m, re)) {
             int Y = std::stoi(m[1].str());
             int M = std::stoi(m[2].str());
@@ -254,16 +856,180 @@ static std::optional<std::time_t> parseFilenameTime(const fs::path& file) {
     return std::nullopt;
 }
 
+// ---------- page cache ----------
+// Metadata reads need a few KB per file, but readahead pulls much more into the page cache and pushes out the
+// data of other services. In batch mode (--keep-page-cache turns it off) each read is wrapped in a
+// PageCacheScope: JPEG headers are read up to the image data with plain positioned reads (no readahead), and
+// the pages the read brought into the cache are dropped again afterwards. Linux only; mincore() counts the pages.
+struct PageCacheStats {
+    uint64_t files = 0;
+    uint64_t headerReads = 0;   // JPEG headers read directly, not by Exiv2
+    uint64_t added = 0;         // bytes the metadata reads brought into the page cache
+    uint64_t dropped = 0;       // of these, dropped again
+};
+
+struct PageCacheScope {
+    PageCacheStats* stats;
+#ifdef __linux__
+    int fd = -1;
+    void* map = nullptr;
+    size_t length = 0;
+    std::vector<unsigned char> before, after;
+#endif
+
+    // stats == nullptr: nothing to do
+    PageCacheScope(const fs::path& file, PageCacheStats* stats_) : stats(stats_) {
+#ifdef __linux__
+        if (!stats) return;
+        fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        STAT_ADD(kStatSyscalls, 1);
+        if (fd < 0) return;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+        struct stat st {};
+        STAT_ADD(kStatSyscalls, 3);
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) return;
+        length = (size_t)st.st_size;
+        map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) { map = nullptr; return; }
+        if (!residentPages(before)) { munmap(map, length); map = nullptr; }
+#else
+        (void)file;
+#endif
+    }
+
+    PageCacheScope(const PageCacheScope&) = delete;
+    PageCacheScope& operator=(const PageCacheScope&) = delete;
+
+    // drops the pages that were not cached before
+    ~PageCacheScope() {
+#ifdef __linux__
+        if (map) {
+            stats->files++;
+            const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            if (residentPages(after)) {
+                size_t runStart = SIZE_MAX;
+                for (size_t p = 0; p <= after.size(); ++p) {
+                    const bool added = p < after.size() && (after[p] & 1) && !(before[p] & 1);
+                    if (p < after.size()) after[p] = added;
+                    if (added) {
+                        stats->added += page;
+                        if (runStart == SIZE_MAX) runStart = p;
+                    }
+                    else if (runStart != SIZE_MAX) {
+                        STAT_ADD(kStatSyscalls, 1);
+                        posix_fadvise(fd, (off_t)(runStart * page), (off_t)((p - runStart) * page), POSIX_FADV_DONTNEED);
+                        runStart = SIZE_MAX;
+                    }
+                }
+                if (residentPages(before)) {
+                    for (size_t p = 0; p < after.size(); ++p) {
+                        if (after[p] && !(before[p] & 1)) stats->dropped += page;
+                    }
+                }
+            }
+            munmap(map, length);
+            STAT_ADD(kStatSyscalls, 1);
+        }
+        if (fd >= 0) { ::close(fd); STAT_ADD(kStatSyscalls, 1); }
+#endif
+    }
+
+#ifdef __linux__
+    bool residentPages(std::vector<unsigned char>& pages) const {
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        pages.resize((length + page - 1) / page);
+        STAT_ADD(kStatSyscalls, 1);
+        return mincore(map, length, pages.data()) == 0;
+    }
+#endif
+
+    // JPEG: the bytes from the start up to and including the SOS segment header (all metadata segments),
+    // read with positioned reads. False for other formats or when the scope is not active.
+    bool readJpegHeader(std::vector<Exiv2::byte>& out) {
+#ifdef __linux__
+        if (!map) return false;
+        constexpr size_t kChunk = 64 * 1024, kMax = 16 * 1024 * 1024;
+        size_t have = 0;
+        auto need = [&](size_t n) {
+            if (n > length || n > kMax) return false;
+            while (have < n) {
+                const size_t want = std::min(std::max(n, have + kChunk), std::min(length, kMax));
+                out.resize(want);
+                const ssize_t r = pread(fd, out.data() + have, want - have, (off_t)have);
+                STAT_ADD(kStatSyscalls, 1);
+                if (r <= 0) return false;
+                STAT_ADD(kStatBytesRead, r);
+                have += (size_t)r;
+            }
+            return true;
+            };
+        if (!need(4) || out[0] != 0xFF || out[1] != 0xD8) return false;
+        size_t pos = 2;
+        for (;;) {
+            if (!need(pos + 2) || out[pos] != 0xFF) return false;
+            const uint8_t marker = out[pos + 1];
+            if (marker == 0xFF) { pos++; continue; }                       // fill byte
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; } // no length
+            if (marker == 0xD9) { pos += 2; break; }                        // EOI
+            if (!need(pos + 4)) return false;
+            const size_t end = pos + 2 + ((size_t)out[pos + 2] << 8 | out[pos + 3]);
+            if (!need(end)) return false;
+            pos = end;
+            if (marker == 0xDA) break;                                      // SOS: image data follows
+        }
+        out.resize(pos);
+        stats->headerReads++;
+        return true;
+#else
+        (void)out;
+        return false;
+#endif
+    }
+};
+
 // ---------- Exiv2: read best shot time ----------
-static std::optional<std::time_t> readShotTimeFromMetadata(const fs::path& file) {
+// Parsed metadata of files without a shot, kept from the read stage so writeExifShotIfMissing() does not open
+// and parse them again. Keyed by path id (stays with the file through sorting), bounded by count.
+struct KeptMetadata {
+    size_t limit = 0;
+    std::unordered_map<uint32_t, std::unique_ptr<Exiv2::Image>> images;
+
+    bool wants() const { return images.size() < limit; }
+    void keep(uint32_t pathId, std::unique_ptr<Exiv2::Image> image) { images[pathId] = std::move(image); }
+    // once per file; worker threads may take different files at the same time (nothing is kept any more)
+    std::unique_ptr<Exiv2::Image> take(uint32_t pathId) {
+        auto it = images.find(pathId);
+        return it == images.end() ? nullptr : std::move(it->second);
+    }
+};
+
+// missingDates: MissingDate bits of the dates writeExifShotIfMissing() would add (none when the format cannot
+// take EXIF), with kMissingDatesKnown; left as it is when the file cannot be read.
+// keep: receives the parsed image when no shot was found and there is something to write.
+// pageCache: drop what the read brings into the page cache (see PageCacheScope), counted there.
+static std::optional<std::time_t> readShotTimeFromMetadata(const fs::path& file, uint8_t* missingDates = nullptr,
+    std::unique_ptr<Exiv2::Image>* keep = nullptr, PageCacheStats* pageCache = nullptr) {
     try {
-        auto image = Exiv2::ImageFactory::open(pathToUtf8(file));
+        PageCacheScope cache(file, pageCache);
+        std::vector<Exiv2::byte> header;
+        STAT_ADD(kStatExiv2Opens, 1);
+        // a kept image is written later, so it must be backed by the file, not by the header bytes
+        auto image = !keep && cache.readJpegHeader(header) ? Exiv2::ImageFactory::open(header.data(), (long)header.size())
+            : Exiv2::ImageFactory::open(pathToUtf8(file));
         if (!image.get()) return std::nullopt;
 
         image->readMetadata();
         auto& exif = image->exifData();
         auto& xmp = image->xmpData();
 
+        uint8_t missing = 0;
+        if (exif.findKey(Exiv2::ExifKey("Exif.Photo.DateTimeOriginal")) == exif.end()) missing |= kMissingDateTimeOriginal;
+        if (exif.findKey(Exiv2::ExifKey("Exif.Photo.DateTimeDigitized")) == exif.end()) missing |= kMissingDateTimeDigitized;
+        if (exif.findKey(Exiv2::ExifKey("Exif.Image.DateTime")) == exif.end()) missing |= kMissingImageDateTime;
+        if (!(image->checkMode(Exiv2::mdExif) & Exiv2::amWrite)) missing = 0;
+        const bool toWrite = missing != 0;
+        if (missingDates) *missingDates = missing | kMissingDatesKnown;
+
         auto tryExifKeys = [&](const std::vector<std::string>& keys) -> std::optional<std::time_t> {
             for (const auto& k : keys) {
                 auto it = exif.findKey(Exiv2::ExifKey(k));
@@ -301,83 +1067,682 @@ static std::optional<std::time_t> readShotTimeFromMetadata(const fs::path& file)
             if (auto t = tryXmpKeys({ "Xmp.xmp.CreateDate" })) return t;
             if (auto t = tryXmpKeys({ "Xmp.photoshop.DateCreated" })) return t;
         }
+        if (keep && toWrite) keep->reset(image.release());
         return std::nullopt;
     }
     catch (...) {
+        STAT_ADD(kStatExceptions, 1);
         return std::nullopt;
     }
 }
 
-// ---------- Exiv2: write EXIF shot time only if missing ----------
-static bool writeExifShotIfMissing(const fs::path& file, std::time_t t, bool verbose) {
-    try {
-        auto img = Exiv2::ImageFactory::open(pathToUtf8(file));
-        if (!img.get()) return false;
-
-        img->readMetadata();
-        auto& exif = img->exifData();
+// ---------- in-place EXIF date insertion ----------
+// Positioned reads and writes on one open file.
+struct RandomAccessFile {
+#ifdef _WIN32
+    HANDLE h = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
 
-        std::string s = toExifString(t);
-        bool changed = false;
+    RandomAccessFile() = default;
+    RandomAccessFile(const RandomAccessFile&) = delete;
+    RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+    ~RandomAccessFile() { close(); }
 
-        Exiv2::ExifKey k1("Exif.Photo.DateTimeOriginal");
-        Exiv2::ExifKey k2("Exif.Photo.DateTimeDigitized");
-        Exiv2::ExifKey k3("Exif.Image.DateTime");
+    bool open(const fs::path& p) {
+        close();
+        STAT_ADD(kStatSyscalls, 1);
+#ifdef _WIN32
+        h = CreateFileW(p.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return h != INVALID_HANDLE_VALUE;
+#else
+        fd = ::open(p.c_str(), O_RDWR | O_CLOEXEC);
+        return fd >= 0;
+#endif
+    }
 
-        if (exif.findKey(k1) == exif.end()) { exif["Exif.Photo.DateTimeOriginal"] = s; changed = true; }
-        if (exif.findKey(k2) == exif.end()) { exif["Exif.Photo.DateTimeDigitized"] = s; changed = true; }
-        if (exif.findKey(k3) == exif.end()) { exif["Exif.Image.DateTime"] = s; changed = true; }
+    // new empty file, replacing an existing one
+    bool create(const fs::path& p) {
+        close();
+        STAT_ADD(kStatSyscalls, 1);
+#ifdef _WIN32
+        h = CreateFileW(p.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+            nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return h != INVALID_HANDLE_VALUE;
+#else
+        fd = ::open(p.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return fd >= 0;
+#endif
+    }
 
-        if (changed) {
-            img->setExifData(exif);
-            img->writeMetadata();
-        }
-        return changed;
+#ifndef _WIN32
+    // name relative to an open folder (AT_FDCWD: relative to the working directory)
+    bool openAt(int dirFd, const char* name) {
+        close();
+        STAT_ADD(kStatSyscalls, 1);
+        fd = ::openat(dirFd, name, O_RDWR | O_CLOEXEC);
+        return fd >= 0;
     }
-    catch (const std::exception& e) {
-        if (verbose) std::cout << "    EXIF write failed: " << e.what() << "\n";
-        return false;
+#endif
+
+    bool isOpen() const {
+#ifdef _WIN32
+        return h != INVALID_HANDLE_VALUE;
+#else
+        return fd >= 0;
+#endif
     }
-    catch (...) {
-        if (verbose) std::cout << "    EXIF write failed: unknown error\n";
-        return false;
+
+    // everything written so far is on disk
+    bool sync() {
+        STAT_ADD(kStatSyscalls, 1);
+#ifdef _WIN32
+        return FlushFileBuffers(h) != 0;
+#else
+        return fdatasync(fd) == 0;
+#endif
     }
-}
 
-// ---------- filesystem times ----------
-static std::time_t to_time_t_from_fs_time(fs::file_time_type ftt) {
-    using namespace std::chrono;
-    auto sctp = time_point_cast<system_clock::duration>(
-        ftt - fs::file_time_type::clock::now() + system_clock::now()
-    );
-    return system_clock::to_time_t(sctp);
-}
+    void close() {
+#ifdef _WIN32
+        if (h != INVALID_HANDLE_VALUE) { CloseHandle(h); STAT_ADD(kStatSyscalls, 1); }
+        h = INVALID_HANDLE_VALUE;
+#else
+        if (fd >= 0) { ::close(fd); STAT_ADD(kStatSyscalls, 1); }
+        fd = -1;
+#endif
+    }
 
+    uint64_t size() const {
+        STAT_ADD(kStatSyscalls, 1);
 #ifdef _WIN32
-struct WinTimes { std::time_t create{}; std::time_t write{}; };
+        LARGE_INTEGER sz{};
+        return GetFileSizeEx(h, &sz) ? (uint64_t)sz.QuadPart : 0;
+#else
+        struct stat st {};
+        return fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+#endif
+    }
 
-static std::optional<std::time_t> filetimeToTimeT(const FILETIME& ft) {
-    ULARGE_INTEGER ull;
-    ull.LowPart = ft.dwLowDateTime;
-    ull.HighPart = ft.dwHighDateTime;
+    bool readAt(uint64_t off, void* buf, size_t n) const {
+        STAT_ADD(kStatSyscalls, 1);
+        STAT_ADD(kStatBytesRead, n);
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = (DWORD)off;
+        ov.OffsetHigh = (DWORD)(off >> 32);
+        DWORD got = 0;
+        return ReadFile(h, buf, (DWORD)n, &got, &ov) && got == n;
+#else
+        return ::pread(fd, buf, n, (off_t)off) == (ssize_t)n;
+#endif
+    }
 
-    constexpr long long WINDOWS_TICK = 10000000LL;
-    constexpr long long SEC_TO_UNIX_EPOCH = 11644473600LL;
+    bool writeAt(uint64_t off, const void* buf, size_t n) {
+        STAT_ADD(kStatSyscalls, 1);
+        STAT_ADD(kStatBytesWritten, n);
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = (DWORD)off;
+        ov.OffsetHigh = (DWORD)(off >> 32);
+        DWORD put = 0;
+        return WriteFile(h, buf, (DWORD)n, &put, &ov) && put == n;
+#else
+        return ::pwrite(fd, buf, n, (off_t)off) == (ssize_t)n;
+#endif
+    }
+};
 
-    long long secondsSince1601 = (long long)(ull.QuadPart / WINDOWS_TICK);
-    long long unixSeconds = secondsSince1601 - SEC_TO_UNIX_EPOCH;
-    if (unixSeconds < 0) return std::nullopt;
-    return (std::time_t)unixSeconds;
+static uint16_t tiffGet16(const unsigned char* p, bool le) {
+    return le ? (uint16_t)(p[0] | (p[1] << 8)) : (uint16_t)((p[0] << 8) | p[1]);
+}
+static uint32_t tiffGet32(const unsigned char* p, bool le) {
+    return le ? (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24)
+        : ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+static void tiffPut16(unsigned char* p, uint16_t v, bool le) {
+    p[le ? 0 : 1] = (unsigned char)v;
+    p[le ? 1 : 0] = (unsigned char)(v >> 8);
+}
+static void tiffPut32(unsigned char* p, uint32_t v, bool le) {
+    for (int i = 0; i < 4; ++i) p[le ? i : 3 - i] = (unsigned char)(v >> (8 * i));
 }
 
-static std::optional<WinTimes> getFileTimesWindows(const fs::path& file) {
-    HANDLE h = CreateFileW(file.wstring().c_str(),
-        FILE_READ_ATTRIBUTES,
-        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        nullptr);
+struct TiffIfd {
+    uint32_t at = 0;                     // offset from the TIFF header
+    std::vector<unsigned char> entries;  // raw 12-byte entries, as in the file
+    uint32_t next = 0;
+
+    size_t count() const { return entries.size() / 12; }
+    unsigned char* entry(size_t i) { return entries.data() + i * 12; }
+    const unsigned char* entry(size_t i) const { return entries.data() + i * 12; }
+
+    int find(uint16_t tag, bool le) const {
+        for (size_t i = 0; i < count(); ++i) {
+            if (tiffGet16(entry(i), le) == tag) return (int)i;
+        }
+        return -1;
+    }
+    // bytes of this IFD with extra ASCII tags of valueSize bytes each
+    static uint32_t bytesWith(size_t entryCount, size_t extraTags, size_t valueSize) {
+        return (uint32_t)(2 + 12 * (entryCount + extraTags) + 4 + extraTags * valueSize);
+    }
+};
+
+// ifd plus ASCII tags (sorted into the entries) all holding value, laid out at offset at:
+// count, entries, next IFD pointer, then the new values. Existing values stay where they are.
+static std::vector<unsigned char> tiffIfdWithTags(const TiffIfd& ifd, const std::vector<uint16_t>& tags,
+    const std::string& value, uint32_t at, bool le) {
+    const size_t n = ifd.count() + tags.size();
+    std::vector<unsigned char> out(TiffIfd::bytesWith(ifd.count(), tags.size(), value.size()));
+    uint32_t valueAt = at + (uint32_t)(2 + 12 * n + 4);
+    tiffPut16(out.data(), (uint16_t)n, le);
+
+    unsigned char* e = out.data() + 2;
+    size_t old = 0, added = 0;
+    while (old < ifd.count() || added < tags.size()) {
+        if (added < tags.size() && (old == ifd.count() || tags[added] < tiffGet16(ifd.entry(old), le))) {
+            tiffPut16(e, tags[added], le);
+            tiffPut16(e + 2, 2, le);                        // ASCII
+            tiffPut32(e + 4, (uint32_t)value.size(), le);
+            tiffPut32(e + 8, valueAt, le);
+            std::memcpy(out.data() + (valueAt - at), value.data(), value.size());
+            valueAt += (uint32_t)value.size();
+            added++;
+        }
+        else {
+            std::memcpy(e, ifd.entry(old), 12);
+            old++;
+        }
+        e += 12;
+    }
+    tiffPut32(e, ifd.next, le);
+    return out;
+}
+
+enum class InPlaceExif {
+    Planned,
+    NothingMissing,
+    NeedsRewrite
+};
+
+struct InPlaceWrite {
+    uint64_t at = 0;
+    std::vector<unsigned char> bytes;
+};
+
+// Plans adding the missing date tags (same keys as writeExifShotIfMissing) without rewriting the file; only
+// reads f. Each IFD that gets tags is copied with them into free space, then one 4-byte pointer is switched to
+// the copy (the last write), so a crash leaves either the old or the new IFD in use. Free space is the end of
+// the file for TIFF/DNG, and the Padding tag (0xEA1C, added by Windows) inside the Exif segment of a JPEG.
+// Anything else (no Exif segment or Exif IFD yet, no padding, BigTIFF, ...) needs the full rewrite by Exiv2.
+static InPlaceExif planExifDatesInPlace(const RandomAccessFile& f, std::time_t t, std::vector<InPlaceWrite>& writes) {
+    if (!f.isOpen()) return InPlaceExif::NeedsRewrite;
+    const uint64_t fileSize = f.size();
+
+    // the TIFF structure: the whole file (TIFF/DNG) or the payload of the Exif APP1 segment (JPEG)
+    uint64_t base = 0, limit = 0;
+    bool appendAtEnd = false;
+    unsigned char head[4];
+    if (!f.readAt(0, head, sizeof(head))) return InPlaceExif::NeedsRewrite;
+    if (head[0] == 0xFF && head[1] == 0xD8) {
+        uint64_t pos = 2;
+        for (int seg = 0; seg < 64 && !limit; ++seg) {
+            unsigned char m[4];
+            if (!f.readAt(pos, m, sizeof(m)) || m[0] != 0xFF || m[1] == 0xFF) return InPlaceExif::NeedsRewrite;
+            if (m[1] == 0xDA || m[1] == 0xD9) break; // image data reached without an Exif segment
+            const uint32_t len = ((uint32_t)m[2] << 8) | m[3];
+            unsigned char id[6];
+            if (m[1] == 0xE1 && len >= 2 + 6 + 8 && f.readAt(pos + 4, id, sizeof(id))
+                && std::memcmp(id, "Exif\0\0", 6) == 0) {
+                base = pos + 4 + 6;
+                limit = len - 2 - 6;
+            }
+            pos += 2 + (uint64_t)len;
+        }
+        if (!limit) return InPlaceExif::NeedsRewrite;
+    }
+    else if ((head[0] == 'I' && head[1] == 'I') || (head[0] == 'M' && head[1] == 'M')) {
+        if (fileSize >= 0xFFFF0000ULL) return InPlaceExif::NeedsRewrite; // offsets are 32-bit
+        limit = fileSize;
+        appendAtEnd = true;
+    }
+    else {
+        return InPlaceExif::NeedsRewrite;
+    }
+
+    auto read = [&](uint64_t off, void* buf, size_t n) { return off + n <= limit && f.readAt(base + off, buf, n); };
+    unsigned char th[8];
+    if (!read(0, th, sizeof(th)) || th[0] != th[1] || (th[0] != 'I' && th[0] != 'M')) return InPlaceExif::NeedsRewrite;
+    const bool le = th[0] == 'I';
+    if (tiffGet16(th + 2, le) != 42) return InPlaceExif::NeedsRewrite;
+
+    auto readIfd = [&](uint32_t at, TiffIfd& ifd) {
+        unsigned char c[4];
+        if (at < 8 || !read(at, c, 2)) return false;
+        const uint16_t n = tiffGet16(c, le);
+        if (n == 0 || n > 1000) return false;
+        ifd.at = at;
+        ifd.entries.resize((size_t)n * 12);
+        if (!read(at + 2, ifd.entries.data(), ifd.entries.size()) || !read(at + 2 + 12ULL * n, c, 4)) return false;
+        ifd.next = tiffGet32(c, le);
+        return true;
+    };
+
+    TiffIfd ifd0, exif;
+    if (!readIfd(tiffGet32(th + 4, le), ifd0)) return InPlaceExif::NeedsRewrite;
+    const int exifPtr = ifd0.find(0x8769, le);
+    if (exifPtr < 0 || !readIfd(tiffGet32(ifd0.entry(exifPtr) + 8, le), exif)) return InPlaceExif::NeedsRewrite;
+
+    std::vector<uint16_t> add0, addExif;
+    if (ifd0.find(0x0132, le) < 0) add0.push_back(0x0132);      // Exif.Image.DateTime
+    if (exif.find(0x9003, le) < 0) addExif.push_back(0x9003);   // Exif.Photo.DateTimeOriginal
+    if (exif.find(0x9004, le) < 0) addExif.push_back(0x9004);   // Exif.Photo.DateTimeDigitized
+    if (add0.empty() && addExif.empty()) return InPlaceExif::NothingMissing;
+
+    std::string value = toExifString(t);
+    value.push_back('\0');
+    const bool moveIfd0 = !add0.empty(), moveExif = !addExif.empty();
+    const uint32_t exifSize = moveExif ? TiffIfd::bytesWith(exif.count(), addExif.size(), value.size()) : 0;
+    const uint32_t ifd0Size = moveIfd0 ? TiffIfd::bytesWith(ifd0.count(), add0.size(), value.size()) : 0;
+    const uint32_t need = exifSize + ifd0Size;
+
+    // free space: [start, start + need) relative to base
+    uint64_t start = 0;
+    std::vector<unsigned char> out;
+    if (appendAtEnd) {
+        if (fileSize & 1) out.push_back(0); // keep word alignment
+        start = (fileSize + 1) & ~uint64_t(1);
+    }
+    else {
+        TiffIfd* owner = nullptr;
+        int pad = -1;
+        for (TiffIfd* ifd : { &ifd0, &exif }) {
+            pad = ifd->find(0xEA1C, le);
+            if (pad >= 0) { owner = ifd; break; }
+        }
+        if (!owner) return InPlaceExif::NeedsRewrite;
+        unsigned char* e = owner->entry(pad);
+        const uint32_t count = tiffGet32(e + 4, le), at = tiffGet32(e + 8, le);
+        start = (at + 1) & ~uint32_t(1);
+        const uint64_t used = start - at + need;
+        if (tiffGet16(e + 2, le) != 7 || count < used + 8 || (uint64_t)at + count > limit) return InPlaceExif::NeedsRewrite;
+
+        // the padding gives up its front part
+        tiffPut32(e + 4, (uint32_t)(count - used), le);
+        tiffPut32(e + 8, (uint32_t)(at + used), le);
+        const bool ownerMoves = owner == &ifd0 ? moveIfd0 : moveExif;
+        if (!ownerMoves) writes.push_back({ base + owner->at + 2 + 12ULL * pad + 4, { e + 4, e + 12 } });
+    }
+
+    const uint32_t exifAt = (uint32_t)start, ifd0At = (uint32_t)start + exifSize;
+    if (moveExif && moveIfd0) tiffPut32(ifd0.entry(exifPtr) + 8, exifAt, le);
+    if (moveExif) {
+        auto b = tiffIfdWithTags(exif, addExif, value, exifAt, le);
+        out.insert(out.end(), b.begin(), b.end());
+    }
+    if (moveIfd0) {
+        auto b = tiffIfdWithTags(ifd0, add0, value, ifd0At, le);
+        out.insert(out.end(), b.begin(), b.end());
+    }
+    const uint64_t outAt = base + start - (out.size() - need); // includes the alignment byte
+    writes.push_back({ outAt, std::move(out) });
+
+    // switch to the copies: the IFD0 pointer in the header, or the Exif pointer in the unchanged IFD0
+    unsigned char ptr[4];
+    tiffPut32(ptr, moveIfd0 ? ifd0At : exifAt, le);
+    const uint64_t ptrAt = moveIfd0 ? base + 4 : base + ifd0.at + 2 + 12ULL * exifPtr + 8;
+    writes.push_back({ ptrAt, { ptr, ptr + sizeof(ptr) } });
+    return InPlaceExif::Planned;
+}
+
+// the writes of planExifDatesInPlace(), in order
+static bool writeInPlace(RandomAccessFile& f, const std::vector<InPlaceWrite>& writes, uint64_t& bytesWritten) {
+    for (const InPlaceWrite& w : writes) {
+        if (!f.writeAt(w.at, w.bytes.data(), w.bytes.size())) return false;
+        bytesWritten += w.bytes.size();
+    }
+    return true;
+}
+
+// ---------- copy-on-write rewrite (Linux reflink) ----------
+// In-place EXIF writes go to a clone of the file (FICLONE: shares all data blocks; btrfs, XFS) that is then
+// swapped in with renameat2(RENAME_EXCHANGE). Readers see the old or the new file, never a half-written one,
+// and only the changed blocks are copied. The swapped-out original is deleted or kept as "<file>.orig".
+// Without reflink support (other filesystems and platforms, hard-linked files) the file is written directly.
+// Whether a device (st_dev) has it is learned from the first clone tried there, so a filesystem without
+// reflink costs one temporary file per run, not one per written file.
+struct ReflinkClone {
+    fs::path file, tmp;    // tmp: the clone until commit(), empty after
+    RandomAccessFile f;    // open on the clone
+
+    struct Devices {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, bool> supported; // st_dev -> FICLONE works
+    };
+    static Devices& devices() {
+        static Devices d;
+        return d;
+    }
+
+    ReflinkClone() = default;
+    ReflinkClone(const ReflinkClone&) = delete;
+    ReflinkClone& operator=(const ReflinkClone&) = delete;
+    ~ReflinkClone() { discard(); }
+
+    // src: the open file
+    bool create(const fs::path& file_, const RandomAccessFile& src) {
+#ifdef __linux__
+        struct stat st {};
+        STAT_ADD(kStatSyscalls, 1);
+        if (!src.isOpen() || fstat(src.fd, &st) != 0 || st.st_nlink != 1) return false;
+        const uint64_t dev = (uint64_t)st.st_dev;
+        Devices& known = devices();
+        {
+            std::lock_guard<std::mutex> lock(known.mutex);
+            auto it = known.supported.find(dev);
+            if (it != known.supported.end() && !it->second) return false;
+        }
+        file = file_;
+        tmp = file.parent_path() / ("." + file.filename().string() + ".ptf-tmp");
+        f.fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        STAT_ADD(kStatSyscalls, 4); // open, ioctl, fchown, fchmod
+        if (f.fd < 0) { tmp.clear(); return false; }
+        const bool cloned = ioctl(f.fd, FICLONE, src.fd) == 0;
+        const int err = errno;
+        if (cloned || err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV) {
+            std::lock_guard<std::mutex> lock(known.mutex);
+            known.supported[dev] = cloned; // not for passing errors (ENOSPC, EIO, ...)
+        }
+        if (!cloned) { discard(); return false; }
+        (void)!fchown(f.fd, st.st_uid, st.st_gid); // only root may; anyone else owns the file already
+        fchmod(f.fd, st.st_mode & 07777);
+        return true;
+#else
+        (void)file_; (void)src;
+        return false;
+#endif
+    }
+
+    // Swaps the clone in (its changes must be complete and the clone open in f).
+    // orig: the original file's descriptor, it is swapped with f so orig is open on the new file after.
+    bool commit(RandomAccessFile& orig, bool keepOriginal) {
+#ifdef __linux__
+        if (f.isOpen() && !f.sync()) return false; // the renamed file must not come back empty after a crash
+        const fs::path backup = fs::path(file).concat(".orig");
+        STAT_ADD(kStatSyscalls, 2);
+        if (renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, file.c_str(), RENAME_EXCHANGE) == 0) {
+            // tmp names the original now
+            if (keepOriginal) ::rename(tmp.c_str(), backup.c_str());
+            else ::unlink(tmp.c_str());
+        }
+        else {
+            // no RENAME_EXCHANGE on this filesystem: plain atomic replace
+            if (keepOriginal) ::link(file.c_str(), backup.c_str());
+            if (::rename(tmp.c_str(), file.c_str()) != 0) return false;
+        }
+        tmp.clear();
+        std::swap(orig.fd, f.fd);
+        f.close();
+        return true;
+#else
+        (void)orig; (void)keepOriginal;
+        return false;
+#endif
+    }
+
+    void discard() {
+        f.close();
+#ifndef _WIN32
+        if (!tmp.empty()) ::unlink(tmp.c_str());
+#endif
+        tmp.clear();
+    }
+};
+
+// ---------- Exiv2: write EXIF shot time only if missing ----------
+struct ExifWriteStats {
+    uint64_t bytes = 0;    // bytes written to the file
+    bool inPlace = false;  // false: Exiv2 rewrote the whole file
+    bool reflink = false;  // written to a reflink clone that replaced the file
+};
+
+// f: the file, open if the caller has it; after the call it is closed or open on the (new) file.
+// parsed: the file's metadata from the read stage (KeptMetadata) if it is unchanged since, else null
+static bool writeExifShotIfMissing(const fs::path& file, RandomAccessFile& f, std::time_t t, const Options& opt,
+    std::unique_ptr<Exiv2::Image> parsed, std::ostream& log, ExifWriteStats& stats) {
+    const bool verbose = opt.verbose;
+    if (opt.exifInPlace) {
+        std::vector<InPlaceWrite> writes;
+        switch (planExifDatesInPlace(f, t, writes)) {
+        case InPlaceExif::Planned: {
+            // cloned only now that a write is certain
+            ReflinkClone clone;
+            const bool cow = opt.reflinkRewrite && clone.create(file, f);
+            if (!writeInPlace(cow ? clone.f : f, writes, stats.bytes)) {
+                stats.bytes = 0;
+                break;
+            }
+            stats.inPlace = true;
+            if (cow && !clone.commit(f, opt.reflinkBackup)) {
+                if (verbose) log << "    EXIF write failed: cannot replace the file with its clone\n";
+                return false;
+            }
+            stats.reflink = cow;
+            return true;
+        }
+        case InPlaceExif::NothingMissing: return false;
+        case InPlaceExif::NeedsRewrite: break;
+        }
+    }
+    // Exiv2 writes a new copy of the whole file, so a clone would not save anything: written directly
+    f.close();
+    try {
+        std::unique_ptr<Exiv2::Image> img = std::move(parsed);
+        if (!img) {
+            STAT_ADD(kStatExiv2Opens, 1);
+            img.reset(Exiv2::ImageFactory::open(pathToUtf8(file)).release());
+            if (!img) return false;
+            img->readMetadata();
+        }
+        auto& exif = img->exifData();
+
+        std::string s = toExifString(t);
+        bool changed = false;
+
+        Exiv2::ExifKey k1("Exif.Photo.DateTimeOriginal");
+        Exiv2::ExifKey k2("Exif.Photo.DateTimeDigitized");
+        Exiv2::ExifKey k3("Exif.Image.DateTime");
+
+        if (exif.findKey(k1) == exif.end()) { exif["Exif.Photo.DateTimeOriginal"] = s; changed = true; }
+        if (exif.findKey(k2) == exif.end()) { exif["Exif.Photo.DateTimeDigitized"] = s; changed = true; }
+        if (exif.findKey(k3) == exif.end()) { exif["Exif.Image.DateTime"] = s; changed = true; }
+
+        if (changed) {
+            img->setExifData(exif);
+            img->writeMetadata();
+            stats.bytes = img->io().size();
+        }
+        return changed;
+    }
+    catch (const std::exception& e) {
+        STAT_ADD(kStatExceptions, 1);
+        if (verbose) log << "    EXIF write failed: " << e.what() << "\n";
+        return false;
+    }
+    catch (...) {
+        STAT_ADD(kStatExceptions, 1);
+        if (verbose) log << "    EXIF write failed: unknown error\n";
+        return false;
+    }
+}
+
+// ---------- XMP sidecar ----------
+// "<file>.xmp" next to the file, so any extension (videos, RAW) can get dates without touching its bytes.
+static fs::path xmpSidecarPath(const fs::path& file) {
+    fs::path p = file;
+    p += ".xmp";
+    return p;
+}
+
+static std::optional<std::time_t> readShotTimeFromSidecar(const fs::path& file) {
+    std::error_code ec;
+    const fs::path sidecar = xmpSidecarPath(file);
+    if (!fs::is_regular_file(sidecar, ec)) return std::nullopt; // common case: no exception from Exiv2
+    return readShotTimeFromMetadata(sidecar);
+}
+
+static std::string toXmpDateString(std::time_t t) {
+    std::string s = toExifString(t); // YYYY:MM:DD HH:MM:SS -> YYYY-MM-DDTHH:MM:SS (local time, like EXIF)
+    s[4] = '-'; s[7] = '-'; s[10] = 'T';
+    return s;
+}
+
+// the sidecar writeXmpSidecarIfMissing() creates for dates t
+static std::string xmpSidecarPacket(std::time_t t) {
+    const std::string s = toXmpDateString(t);
+    return "<?xpacket begin=\"\xEF\xBB\xBF\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n"
+        "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n"
+        " <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n"
+        "  <rdf:Description rdf:about=\"\"\n"
+        "    xmlns:xmp=\"http://ns.adobe.com/xap/1.0/\"\n"
+        "    xmlns:exif=\"http://ns.adobe.com/exif/1.0/\"\n"
+        "    xmlns:photoshop=\"http://ns.adobe.com/photoshop/1.0/\"\n"
+        "   xmp:CreateDate=\"" + s + "\"\n"
+        "   exif:DateTimeOriginal=\"" + s + "\"\n"
+        "   photoshop:DateCreated=\"" + s + "\"/>\n"
+        " </rdf:RDF>\n"
+        "</x:xmpmeta>\n"
+        "<?xpacket end=\"w\"?>\n";
+}
+
+// Writes the dates into the sidecar if it has none. A new sidecar is written directly without a sync:
+// syncXmpSidecars() makes the run's sidecars durable per folder. Existing sidecars are updated by Exiv2.
+static bool writeXmpSidecarIfMissing(const fs::path& file, std::time_t t, bool verbose, std::ostream& log,
+    uint64_t& bytesWritten) {
+    const fs::path sidecar = xmpSidecarPath(file);
+    const std::string s = toXmpDateString(t);
+    std::error_code ec;
+    const auto size = fs::file_size(sidecar, ec);
+    if (ec || size == 0) { // none yet (or left empty by a crash)
+        const std::string packet = xmpSidecarPacket(t);
+        std::ofstream out(sidecar, std::ios::binary | std::ios::trunc);
+        if (!out.write(packet.data(), (std::streamsize)packet.size()) || !out.flush()) {
+            if (verbose) log << "    XMP sidecar write failed: " << pathToUtf8(sidecar) << "\n";
+            return false;
+        }
+        bytesWritten = packet.size();
+        return true;
+    }
+    try {
+        STAT_ADD(kStatExiv2Opens, 1);
+        auto img = Exiv2::ImageFactory::open(pathToUtf8(sidecar));
+        if (!img.get()) return false;
+
+        img->readMetadata();
+        auto& xmp = img->xmpData();
+
+        bool changed = false;
+        for (const char* k : { "Xmp.xmp.CreateDate", "Xmp.exif.DateTimeOriginal", "Xmp.photoshop.DateCreated" }) {
+            if (xmp.findKey(Exiv2::XmpKey(k)) == xmp.end()) { xmp[k] = s; changed = true; }
+        }
+        if (changed) {
+            img->writeMetadata();
+            bytesWritten = img->io().size();
+        }
+        return changed;
+    }
+    catch (const std::exception& e) {
+        STAT_ADD(kStatExceptions, 1);
+        if (verbose) log << "    XMP sidecar write failed: " << e.what() << "\n";
+        return false;
+    }
+    catch (...) {
+        STAT_ADD(kStatExceptions, 1);
+        if (verbose) log << "    XMP sidecar write failed: unknown error\n";
+        return false;
+    }
+}
+
+// Makes the sidecars written by this run durable with one sync per folder instead of one per file.
+// Linux: syncfs() once per filesystem, then fsync() of each folder for the new names. Other POSIX
+// systems have no syncfs, sync() stands in for it. Windows has no folder sync, sidecars are flushed
+// one by one. Returns the number of folders synced.
+static size_t syncXmpSidecars(const ItemTable& items) {
+    std::vector<uint32_t> dirs;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (items.flags[i] & kXmpWritten) dirs.push_back(items.paths.dirOf(items.pathId[i]));
+    }
+    std::sort(dirs.begin(), dirs.end());
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+#ifdef _WIN32
+    std::string buf;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (!(items.flags[i] & kXmpWritten)) continue;
+        HANDLE h = CreateFileW(xmpSidecarPath(itemPath(items, i, buf)).wstring().c_str(), GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE) continue;
+        FlushFileBuffers(h);
+        CloseHandle(h);
+    }
+#else
+    std::vector<uint64_t> synced; // filesystems
+    for (uint32_t d : dirs) {
+        const std::string& dirText = *items.paths.dirs[d];
+        int fd = ::open(dirText.empty() ? "." : dirText.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && std::find(synced.begin(), synced.end(), (uint64_t)st.st_dev) == synced.end()) {
+            synced.push_back((uint64_t)st.st_dev);
+#ifdef __linux__
+            syncfs(fd);
+#else
+            ::sync();
+#endif
+        }
+        fsync(fd);
+        ::close(fd);
+    }
+#endif
+    return dirs.size();
+}
+
+// ---------- filesystem times ----------
+#ifdef _WIN32
+static std::time_t to_time_t_from_fs_time(fs::file_time_type ftt) {
+    using namespace std::chrono;
+    auto sctp = time_point_cast<system_clock::duration>(
+        ftt - fs::file_time_type::clock::now() + system_clock::now()
+    );
+    return system_clock::to_time_t(sctp);
+}
+
+struct WinTimes { std::time_t create{}; std::time_t write{}; };
+
+static std::optional<std::time_t> filetimeToTimeT(const FILETIME& ft) {
+    ULARGE_INTEGER ull;
+    ull.LowPart = ft.dwLowDateTime;
+    ull.HighPart = ft.dwHighDateTime;
+
+    constexpr long long WINDOWS_TICK = 10000000LL;
+    constexpr long long SEC_TO_UNIX_EPOCH = 11644473600LL;
+
+    long long secondsSince1601 = (long long)(ull.QuadPart / WINDOWS_TICK);
+    long long unixSeconds = secondsSince1601 - SEC_TO_UNIX_EPOCH;
+    if (unixSeconds < 0) return std::nullopt;
+    return (std::time_t)unixSeconds;
+}
+
+static std::optional<WinTimes> getFileTimesWindows(const fs::path& file) {
+    HANDLE h = CreateFileW(file.wstring().c_str(),
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
     if (h == INVALID_HANDLE_VALUE) return std::nullopt;
 
     FILETIME c{}, a{}, w{};
@@ -392,7 +1757,7 @@ static std::optional<WinTimes> getFileTimesWindows(const fs::path& file) {
     return WinTimes{ *tc, *tw };
 }
 
-static bool setFileTimesWindows(const fs::path& file, std::time_t t, bool verbose) {
+static FILETIME timeTToFiletime(std::time_t t) {
     constexpr long long WINDOWS_TICK = 10000000LL;
     constexpr long long SEC_TO_UNIX_EPOCH = 11644473600LL;
 
@@ -401,6 +1766,11 @@ static bool setFileTimesWindows(const fs::path& file, std::time_t t, bool verbos
     FILETIME ft;
     ft.dwLowDateTime = static_cast<DWORD>(ft64 & 0xFFFFFFFF);
     ft.dwHighDateTime = static_cast<DWORD>((ft64 >> 32) & 0xFFFFFFFF);
+    return ft;
+}
+
+static bool setFileTimesWindows(const fs::path& file, std::time_t t, bool verbose, std::ostream& log) {
+    FILETIME ft = timeTToFiletime(t);
 
     HANDLE h = CreateFileW(file.wstring().c_str(),
         FILE_WRITE_ATTRIBUTES,
@@ -410,42 +1780,128 @@ static bool setFileTimesWindows(const fs::path& file, std::time_t t, bool verbos
         FILE_ATTRIBUTE_NORMAL,
         nullptr);
     if (h == INVALID_HANDLE_VALUE) {
-        if (verbose) std::cout << "    SetFileTime: cannot open (err=" << GetLastError() << ")\n";
+        if (verbose) log << "    SetFileTime: cannot open (err=" << GetLastError() << ")\n";
         return false;
     }
 
     BOOL ok = SetFileTime(h, &ft, &ft, &ft); // create/access/write
-    if (!ok && verbose) std::cout << "    SetFileTime failed (err=" << GetLastError() << ")\n";
+    if (!ok && verbose) log << "    SetFileTime failed (err=" << GetLastError() << ")\n";
     CloseHandle(h);
     return ok != 0;
 }
 #else
-static bool setFileTimesPosix(const fs::path& file, std::time_t t, bool verbose) {
+// fd >= 0: set through the open file (futimens), else name relative to dirFd (utimensat)
+static bool setFileTimesPosix(int fd, int dirFd, const char* name, std::time_t t, bool verbose, std::ostream& log) {
     timespec ts[2];
     ts[0].tv_sec = t; ts[0].tv_nsec = 0; // atime
     ts[1].tv_sec = t; ts[1].tv_nsec = 0; // mtime
-    int ret = utimensat(AT_FDCWD, file.c_str(), ts, 0);
-    if (ret != 0 && verbose) std::cout << "    utimensat failed\n";
+    STAT_ADD(kStatSyscalls, 1);
+    int ret = fd >= 0 ? futimens(fd, ts) : utimensat(dirFd, name, ts, 0);
+    if (ret != 0 && verbose) log << (fd >= 0 ? "    futimens failed\n" : "    utimensat failed\n");
     return ret == 0;
 }
 #endif
 
+// times already are exactly what the sync would set (POSIX: atime and mtime t with 0 ns; Windows: create,
+// access and write t): nothing to set. The scanned seconds rule out most files without a system call; the rest
+// are checked now, since reading the metadata may have moved the access time since the scan (relatime).
+#ifdef _WIN32
+static bool fileTimesMatch(const ItemTable& items, size_t i, int64_t t, const fs::path& file) {
+    if (items.ctime[i] != t || items.wtime[i] != t) return false;
+    HANDLE h = CreateFileW(file.wstring().c_str(),
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    FILETIME c{}, a{}, w{};
+    BOOL ok = GetFileTime(h, &c, &a, &w);
+    CloseHandle(h);
+    if (!ok) return false;
+    const FILETIME ft = timeTToFiletime((std::time_t)t);
+    auto same = [&](const FILETIME& x) {
+        return x.dwLowDateTime == ft.dwLowDateTime && x.dwHighDateTime == ft.dwHighDateTime;
+    };
+    return same(c) && same(a) && same(w);
+}
+#else
+// fd >= 0: check the open file (fstat), else name relative to dirFd (fstatat)
+static bool fileTimesMatch(const ItemTable& items, size_t i, int64_t t, int fd, int dirFd, const char* name) {
+    if (items.mtime[i] != t) return false;
+    struct stat st {};
+    STAT_ADD(kStatSyscalls, 1);
+    if ((fd >= 0 ? ::fstat(fd, &st) : ::fstatat(dirFd, name, &st, 0)) != 0) return false;
+    return st.st_atim.tv_sec == t && st.st_atim.tv_nsec == 0
+        && st.st_mtim.tv_sec == t && st.st_mtim.tv_nsec == 0;
+}
+#endif
+
 // ---------- collect files ----------
-static void collectFiles(const fs::path& root, bool recursive, std::vector<Item>& out) {
+struct FileStat {
+    int64_t mtime = 0;
+    uint64_t size = 0;
+    int64_t ctime = kNoTime;   // Windows create/write times
+    int64_t wtime = kNoTime;
+};
+
+static FileStat statFile(const fs::path& p) {
+    FileStat fst;
+#ifdef _WIN32
     std::error_code ec;
+    fst.mtime = (int64_t)to_time_t_from_fs_time(fs::last_write_time(p, ec));
+    auto size = fs::file_size(p, ec);
+    fst.size = ec ? 0 : (uint64_t)size;
+    if (auto wt = getFileTimesWindows(p)) {
+        fst.ctime = (int64_t)wt->create;
+        fst.wtime = (int64_t)wt->write;
+    }
+#else
+    // one stat() gives the exact seconds (the file_clock conversion may round) and the size
+    struct stat st {};
+    STAT_ADD(kStatSyscalls, 1);
+    if (::stat(p.c_str(), &st) == 0) {
+        fst.mtime = (int64_t)st.st_mtime;
+        fst.size = (uint64_t)st.st_size;
+    }
+#endif
+    return fst;
+}
 
-    if (fs::is_regular_file(root, ec)) {
-        if (hasMediaExt(root)) { // 改：图片或视频
-            Item it;
-            it.path = root;
-            it.mtime = to_time_t_from_fs_time(fs::last_write_time(root, ec));
+static bool addItem(ItemTable& items, const fs::path& p) {
+    if (!items.add(pathToUtf8(p))) return false;
+    const size_t i = items.size() - 1;
+    const FileStat fst = statFile(p);
+    items.mtime[i] = fst.mtime;
+    items.fileSize[i] = fst.size;
 #ifdef _WIN32
-            if (auto wt = getFileTimesWindows(root)) {
-                it.ctime = wt->create;
-                it.wtime = wt->write;
-            }
+    items.ctime[i] = fst.ctime;
+    items.wtime[i] = fst.wtime;
 #endif
-            out.push_back(std::move(it));
+    return true;
+}
+
+// trace: one span per folder, from its first media file to the next folder's
+struct FolderSpans {
+    TraceSpan span;
+    uint32_t dir = UINT32_MAX;
+
+    void added(const ItemTable& items) {
+        if (!tracer().on || items.paths.lastDir == dir) return;
+        dir = items.paths.lastDir;
+        span.begin("scan folder", "folder id", dir, *items.paths.dirs[dir]);
+    }
+};
+
+// scanned: counts the files found, if given (progress)
+static void collectFiles(const fs::path& root, bool recursive, ItemTable& out, std::atomic<uint64_t>* scanned = nullptr) {
+    std::error_code ec;
+    FolderSpans folders;
+
+    if (fs::is_regular_file(root, ec)) {
+        if (hasMediaExt(root)) { // 改：图片或视频
+            addItem(out, root);
         }
         return;
     }
@@ -460,16 +1916,12 @@ static void collectFiles(const fs::path& root, bool recursive, std::vector<Item>
             fs::path p = it->path();
             if (!hasMediaExt(p)) continue; // 改：图片或视频
 
-            Item item;
-            item.path = p;
-            item.mtime = to_time_t_from_fs_time(fs::last_write_time(p, ec));
-#ifdef _WIN32
-            if (auto wt = getFileTimesWindows(p)) {
-                item.ctime = wt->create;
-                item.wtime = wt->write;
+            if (!addItem(out, p)) {
+                std::cout << "Too many files (path storage full), scan stopped.\n";
+                return;
             }
-#endif
-            out.push_back(std::move(item));
+            folders.added(out);
+            if (scanned) scanned->fetch_add(1, std::memory_order_relaxed);
         }
     }
     else {
@@ -480,244 +1932,4435 @@ static void collectFiles(const fs::path& root, bool recursive, std::vector<Item>
             fs::path p = it->path();
             if (!hasMediaExt(p)) continue; // 改：图片或视频
 
-            Item item;
-            item.path = p;
-            item.mtime = to_time_t_from_fs_time(fs::last_write_time(p, ec));
-#ifdef _WIN32
-            if (auto wt = getFileTimesWindows(p)) {
-                item.ctime = wt->create;
-                item.wtime = wt->write;
+            if (!addItem(out, p)) {
+                std::cout << "Too many files (path storage full), scan stopped.\n";
+                return;
             }
-#endif
-            out.push_back(std::move(item));
+            folders.added(out);
+            if (scanned) scanned->fetch_add(1, std::memory_order_relaxed);
         }
     }
 }
 
 
 // ---------- choose shot time (anchor) ----------
-static void fillShotTime(Item& it, const Options& opt) {
-    // 1) Try metadata
-    if (auto t = readShotTimeFromMetadata(it.path)) {
-        it.shot = t;
-        it.shotSource = ShotSource::ExifOrXmp;
+// kept: where to keep the parsed metadata for the EXIF write, if it has room
+// pageCache: with opt.dropPageCache, the page cache the read left behind is counted here
+static void fillShotTime(ItemTable& items, size_t i, const Options& opt, KeptMetadata* kept = nullptr,
+    PageCacheStats* pageCache = nullptr) {
+    const fs::path path = itemPath(items, i);
+
+    // 1) Try metadata (and the sidecar an earlier --xmp-sidecar run wrote)
+    uint8_t missing = 0;
+    std::unique_ptr<Exiv2::Image> parsed;
+    if (auto t = readShotTimeFromMetadata(path, &missing, kept && kept->wants() ? &parsed : nullptr,
+        opt.dropPageCache ? pageCache : nullptr)) {
+        items.shot[i] = (int64_t)*t;
+        items.shotSource[i] = ShotSource::ExifOrXmp;
         return;
     }
+    items.missingDates[i] = missing;
+    if (missing == kMissingDatesKnown) items.flags[i] |= kNoExifToWrite;
+    if (parsed) kept->keep(items.pathId[i], std::move(parsed));
+    if (opt.xmpSidecar) {
+        if (auto t = readShotTimeFromSidecar(path)) {
+            items.shot[i] = (int64_t)*t;
+            items.shotSource[i] = ShotSource::ExifOrXmp;
+            return;
+        }
+    }
 
     // 2) Optional filename fallback
     if (opt.enableFilenameFallbackForShot) {
-        if (auto nt = parseFilenameTime(it.path)) {
-            it.shot = nt;
-            it.shotSource = ShotSource::Filename;
+        if (auto nt = parseFilenameTime(path)) {
+            items.shot[i] = (int64_t)*nt;
+            items.shotSource[i] = ShotSource::Filename;
             return;
         }
     }
 
-    it.shot = std::nullopt;
-    it.shotSource = ShotSource::None;
+    items.shot[i] = kNoTime;
+    items.shotSource[i] = ShotSource::None;
 }
 
 // ---------- filename override rule for target ----------
-static void applyFilenameOverrideForTarget(Item& it, const Options& opt) {
+static void applyFilenameOverrideForTarget(ItemTable& items, size_t i, const Options& opt) {
     if (!opt.enableFilenameOverrideForTarget) return;
 
-    auto nt = parseFilenameTime(it.path);
+    // only the stem matters, no need for the full path
+    auto nt = parseFilenameTime(pathFromUtf8(std::string(items.fileName(i))));
     if (!nt) return;
 
     long long thresholdSec = opt.filenameOverrideDays * 86400LL;
 
 #ifdef _WIN32
     // If both create and write times exist and both are far from filename time, override.
-    if (it.ctime && it.wtime) {
-        long long dc = absDiffSec(*it.ctime, *nt);
-        long long dw = absDiffSec(*it.wtime, *nt);
+    if (items.ctime[i] != kNoTime && items.wtime[i] != kNoTime) {
+        long long dc = absDiffSec((std::time_t)items.ctime[i], *nt);
+        long long dw = absDiffSec((std::time_t)items.wtime[i], *nt);
         if (dc > thresholdSec && dw > thresholdSec) {
-            it.target = nt;
-            it.targetReason = "filename override (fs create/write too far)";
+            items.target[i] = (int64_t)*nt;
+            items.reason[i] = TargetReason::FilenameOverrideFsTimes;
         }
     }
     else {
         // Fallback: compare mtime only
-        long long dm = absDiffSec(it.mtime, *nt);
+        long long dm = absDiffSec((std::time_t)items.mtime[i], *nt);
         if (dm > thresholdSec) {
-            it.target = nt;
-            it.targetReason = "filename override (mtime too far)";
+            items.target[i] = (int64_t)*nt;
+            items.reason[i] = TargetReason::FilenameOverrideMtime;
         }
     }
 #else
-    long long dm = absDiffSec(it.mtime, *nt);
+    long long dm = absDiffSec((std::time_t)items.mtime[i], *nt);
     if (dm > thresholdSec) {
-        it.target = nt;
-        it.targetReason = "filename override (mtime too far)";
+        items.target[i] = (int64_t)*nt;
+        items.reason[i] = TargetReason::FilenameOverrideMtime;
     }
 #endif
 }
 
+// ---------- target reason text ----------
+static const char* reasonName(TargetReason r) {
+    switch (r) {
+    case TargetReason::ShotFromMetadata: return "shot from metadata";
+    case TargetReason::ShotFromFilename: return "shot from filename";
+    case TargetReason::FilenameOverrideFsTimes: return "filename override (fs create/write too far)";
+    case TargetReason::FilenameOverrideMtime: return "filename override (mtime too far)";
+    case TargetReason::GapTooLarge: return "gap too large -> nearest anchor fill";
+    case TargetReason::AnchorsTooClose: return "anchors too close -> step-filled";
+    case TargetReason::Interpolated: return "interpolated between anchors";
+    case TargetReason::OnlyPrevSteps: return "only prev anchor -> filled +1s steps";
+    case TargetReason::OnlyPrev: return "only prev anchor -> filled";
+    case TargetReason::OnlyNextSteps: return "only next anchor -> filled -1s steps";
+    case TargetReason::OnlyNext: return "only next anchor -> filled";
+    default: return "";
+    }
+}
+
+static std::string reasonText(TargetReason r, uint8_t flags) {
+    std::string s = reasonName(r);
+    auto append = [&](const char* part) {
+        if (!s.empty()) s += " + ";
+        s += part;
+        };
+    if (flags & kUniqueBumped) append("unique(+1s steps)");
+    if (flags & kUniqueNearest) append("unique(nearest free second)");
+    return s;
+}
+
 // ---------- interpolation for missing shot times ----------
-static void inferMissingByInterpolation(std::vector<Item>& items, const Options& opt) {
-    // items must be sorted by mtime
+// Target for the k-th (1-based) of m consecutive files without shot, given the anchors around the gap
+// (kNoTime if there is none). Shared by inferMissingByInterpolation() and the anchor index query so both always agree.
+static int64_t gapFillTarget(int64_t Tprev, int64_t Tnext, long long m, long long k, const Options& opt,
+    TargetReason& reason) {
     long long gapLimitSec = opt.anchorGapLimitDays * 86400LL;
+    long long j = k - 1;
+
+    if (Tprev != kNoTime && Tnext != kNoTime) {
+        long long gap = (long long)(Tnext - Tprev);
+        if (std::llabs(gap) > gapLimitSec) {
+            // Too large gap: avoid interpolation -> nearest fill by position
+            reason = TargetReason::GapTooLarge;
+            return (j < m / 2 ? Tprev : Tnext);
+        }
+
+        // Improved interpolation: guarantee distinct timestamps when anchors are too close
+        long long absGap = std::llabs(gap);
 
+        // Need at least (m+1) seconds difference to give every missing file a unique second
+        // Example: m=5 => need >=6 seconds span between anchors.
+        if (absGap < m + 1) {
+            // Force step fill to avoid same-timestamp collapse
+            long long dir = (gap >= 0) ? 1 : -1; // keep monotonic direction consistent with anchors
+            reason = TargetReason::AnchorsTooClose;
+            return Tprev + dir * k * opt.oneSideStepSeconds;
+        }
+
+        // True linear interpolation (enough span)
+        long long add = gap * k / (m + 1);
+        reason = TargetReason::Interpolated;
+        return Tprev + add;
+    }
+    if (Tprev != kNoTime) {
+        // j 从 0 开始，所以用 (j+1) 才是 prev+1s, prev+2s...
+        reason = opt.oneSideStep ? TargetReason::OnlyPrevSteps : TargetReason::OnlyPrev;
+        return opt.oneSideStep ? Tprev + (j + 1) * opt.oneSideStepSeconds : Tprev;
+    }
+    if (Tnext != kNoTime) {
+        // 让最靠近 next 的那张是 next-1s，保证都落在 next 之前
+        reason = opt.oneSideStep ? TargetReason::OnlyNextSteps : TargetReason::OnlyNext;
+        return opt.oneSideStep ? Tnext - (m - j) * opt.oneSideStepSeconds : Tnext;
+    }
+    // no anchors at all: leave empty
+    return kNoTime;
+}
+
+// [first, last) limits the work to some segments; its ends must be anchors or the ends of items.
+static void inferMissingByInterpolation(ItemTable& items, const Options& opt,
+    size_t first = 0, size_t last = SIZE_MAX) {
+    // items must be sorted by mtime
     int n = (int)items.size();
-    int i = 0;
-    while (i < n) {
-        if (items[i].shot) { i++; continue; }
+    int end = (int)std::min(last, items.size());
+    int i = (int)first;
+    while (i < end) {
+        if (items.hasShot(i)) { i++; continue; }
 
         int L = i;
-        while (i < n && !items[i].shot) i++;
+        while (i < end && !items.hasShot(i)) i++;
         int R = i - 1;
         int m = R - L + 1;
 
-        std::optional<std::time_t> Tprev, Tnext;
-        if (L - 1 >= 0) Tprev = items[L - 1].shot;
-        if (R + 1 < n)  Tnext = items[R + 1].shot;
+        int64_t Tprev = kNoTime, Tnext = kNoTime;
+        if (L - 1 >= 0) Tprev = items.shot[L - 1];
+        if (R + 1 < n)  Tnext = items.shot[R + 1];
 
         // We only set target here (for missing shot ones), but not overwrite existing target chosen by filename override.
-        auto setIfEmptyTarget = [&](int idx, std::time_t t, const std::string& reason) {
-            if (!items[idx].target) {
-                items[idx].target = t;
-                items[idx].targetReason = reason;
-            }
-            };
-
-        if (Tprev && Tnext) {
-            long long gap = (long long)(*Tnext - *Tprev);
-            if (std::llabs(gap) > gapLimitSec) {
-                // Too large gap: avoid interpolation -> nearest fill by position
-                for (int j = 0; j < m; ++j) {
-                    std::time_t t = (j < m / 2 ? *Tprev : *Tnext);
-                    setIfEmptyTarget(L + j, t, "gap too large -> nearest anchor fill");
-                }
-            }
-            else {
-                // Improved interpolation: guarantee distinct timestamps when anchors are too close
-                long long absGap = std::llabs(gap);
-
-                // Need at least (m+1) seconds difference to give every missing file a unique second
-                // Example: m=5 => need >=6 seconds span between anchors.
-                if (absGap < (long long)(m + 1)) {
-                    // Force step fill to avoid same-timestamp collapse
-                    long long dir = (gap >= 0) ? 1 : -1; // keep monotonic direction consistent with anchors
-                    for (int k = 1; k <= m; ++k) {
-                        std::time_t t = (std::time_t)((long long)(*Tprev) + dir * k * opt.oneSideStepSeconds);
-                        setIfEmptyTarget(L + (k - 1), t, "anchors too close -> step-filled");
-                    }
-                }
-                else {
-                    // True linear interpolation (enough span)
-                    for (int k = 1; k <= m; ++k) {
-                        long long add = gap * k / (m + 1);
-                        std::time_t t = (std::time_t)((long long)(*Tprev) + add);
-                        setIfEmptyTarget(L + (k - 1), t, "interpolated between anchors");
-                    }
-                }
-            }
-        }
-        else if (Tprev && !Tnext) {
-            for (int j = 0; j < m; ++j) {
-                // j 从 0 开始，所以用 (j+1) 才是 prev+1s, prev+2s...
-                std::time_t t = opt.oneSideStep ? (*Tprev + (j + 1) * opt.oneSideStepSeconds) : *Tprev;
-                setIfEmptyTarget(L + j, t,
-                    opt.oneSideStep ? "only prev anchor -> filled +1s steps" : "only prev anchor -> filled");
-            }
-        }
-        else if (!Tprev && Tnext) {
-            for (int j = 0; j < m; ++j) {
-                // 让最靠近 next 的那张是 next-1s，保证都落在 next 之前
-                std::time_t t = opt.oneSideStep ? (*Tnext - (m - j) * opt.oneSideStepSeconds) : *Tnext;
-                setIfEmptyTarget(L + j, t,
-                    opt.oneSideStep ? "only next anchor -> filled -1s steps" : "only next anchor -> filled");
+        for (int k = 1; k <= m; ++k) {
+            const size_t row = (size_t)(L + (k - 1));
+            if (items.hasTarget(row)) continue;
+            TargetReason reason = TargetReason::None;
+            int64_t t = gapFillTarget(Tprev, Tnext, m, k, opt, reason);
+            if (t != kNoTime) {
+                items.target[row] = t;
+                items.reason[row] = reason;
             }
         }
-
+    }
+}
+// ---------- make filled targets unique (+1s/+2s ...) ----------
+static void makeFilledTargetsStrictlyIncreasing(ItemTable& items, const Options& opt) {
+    // assumes items already sorted by mtime
+    const long long step = std::max(1LL, opt.oneSideStepSeconds);
+
+    int64_t prevTarget = kNoTime;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (!items.hasTarget(i)) continue;
+
+        // 只修正“需要推断出来的文件”：也就是原本没有 shot 的那批 ([FILL])
+        const bool isFilled = !items.hasShot(i);
+
+        if (prevTarget != kNoTime && isFilled && items.target[i] <= prevTarget) {
+            // bump to prev+step, prev+2step, ...
+            items.target[i] = prevTarget + step;
+            items.flags[i] |= kUniqueBumped;
+        }
+
+        // 更新 prevTarget：以“最终 target”为准
+        prevTarget = items.target[i];
+    }
+}
+
+// ---------- occupied seconds (roaring-style bitmap) ----------
+// Set of seconds already used by a target. Seconds are grouped in chunks of 2^16; a chunk keeps a sorted
+// array of offsets while sparse and switches to a 65536-bit bitmap above 4096 entries, like roaring bitmaps,
+// so free-second searches in dense regions scan 64 seconds per step.
+struct OccupiedSeconds {
+    static constexpr uint32_t kArrayMax = 4096;
+
+    struct Chunk {
+        std::vector<uint16_t> array;   // sorted offsets, while count <= kArrayMax
+        std::vector<uint64_t> bits;    // 1024 words once dense
+        uint32_t count = 0;
+    };
+    std::unordered_map<int64_t, Chunk> chunks;
+
+    static int64_t keyOf(int64_t t) { return t >> 16; }
+    static uint32_t lowOf(int64_t t) { return (uint32_t)(t & 0xFFFF); }
+
+    bool contains(int64_t t) const {
+        auto c = chunks.find(keyOf(t));
+        if (c == chunks.end()) return false;
+        const uint32_t low = lowOf(t);
+        if (!c->second.bits.empty()) return (c->second.bits[low >> 6] >> (low & 63)) & 1;
+        return std::binary_search(c->second.array.begin(), c->second.array.end(), (uint16_t)low);
+    }
+
+    void insert(int64_t t) {
+        Chunk& c = chunks[keyOf(t)];
+        const uint32_t low = lowOf(t);
+        if (!c.bits.empty()) {
+            uint64_t& w = c.bits[low >> 6];
+            const uint64_t bit = 1ULL << (low & 63);
+            if (!(w & bit)) { w |= bit; c.count++; }
+            return;
+        }
+        auto pos = std::lower_bound(c.array.begin(), c.array.end(), (uint16_t)low);
+        if (pos != c.array.end() && *pos == low) return;
+        c.array.insert(pos, (uint16_t)low);
+        c.count++;
+        if (c.count > kArrayMax) {
+            c.bits.assign(1024, 0);
+            for (uint16_t v : c.array) c.bits[v >> 6] |= 1ULL << (v & 63);
+            c.array.clear();
+            c.array.shrink_to_fit();
+        }
+    }
+
+    // smallest free second >= t
+    int64_t nextFree(int64_t t) const {
+        for (;;) {
+            auto c = chunks.find(keyOf(t));
+            if (c == chunks.end()) return t;
+            const Chunk& ch = c->second;
+            const int64_t base = keyOf(t) << 16;
+            uint32_t low = lowOf(t);
+            if (!ch.bits.empty()) {
+                uint32_t w = low >> 6;
+                uint64_t freeBits = ~ch.bits[w] & (~0ULL << (low & 63));
+                while (!freeBits && ++w < 1024) freeBits = ~ch.bits[w];
+                if (freeBits) return base + (int64_t)w * 64 + lowestBit(freeBits);
+            }
+            else {
+                auto pos = std::lower_bound(ch.array.begin(), ch.array.end(), (uint16_t)low);
+                while (pos != ch.array.end() && *pos == low) { ++pos; ++low; }
+                if (low <= 0xFFFF) return base + low;
+            }
+            t = base + 0x10000; // chunk full from t on
+        }
+    }
+
+    // largest free second <= t
+    int64_t prevFree(int64_t t) const {
+        for (;;) {
+            auto c = chunks.find(keyOf(t));
+            if (c == chunks.end()) return t;
+            const Chunk& ch = c->second;
+            const int64_t base = keyOf(t) << 16;
+            int64_t low = lowOf(t);
+            if (!ch.bits.empty()) {
+                int w = (int)(low >> 6);
+                uint64_t freeBits = ~ch.bits[w] & (~0ULL >> (63 - (low & 63)));
+                while (!freeBits && --w >= 0) freeBits = ~ch.bits[w];
+                if (freeBits) return base + (int64_t)w * 64 + highestBit(freeBits);
+            }
+            else {
+                auto pos = std::upper_bound(ch.array.begin(), ch.array.end(), (uint16_t)low);
+                while (pos != ch.array.begin() && *(pos - 1) == low) { --pos; --low; }
+                if (low >= 0) return base + low;
+            }
+            t = base - 1; // chunk full up to t
+        }
+    }
+
+    static int lowestBit(uint64_t x) {
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long i;
+        _BitScanForward64(&i, x);
+        return (int)i;
+#elif defined(__GNUC__)
+        return __builtin_ctzll(x);
+#else
+        int n = 0;
+        while (!(x & 1)) { x >>= 1; n++; }
+        return n;
+#endif
+    }
+    static int highestBit(uint64_t x) {
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long i;
+        _BitScanReverse64(&i, x);
+        return (int)i;
+#elif defined(__GNUC__)
+        return 63 - __builtin_clzll(x);
+#else
+        int n = 63;
+        while (!(x >> 63)) { x <<= 1; n--; }
+        return n;
+#endif
+    }
+};
+
+// ---------- make filled targets unique (nearest free second) ----------
+// Anchor targets are fixed and marked first. Then files without shot, in timeline order, take the free second
+// nearest to their planned target (ties go later). Consecutive files planned on the same second form a burst:
+// it is spread around that second with two cursors and handed out in timeline order, so a burst of k files costs
+// O(k) and never pushes into seconds owned by anchors further on.
+static void allocateUniqueFilledTargets(ItemTable& items) {
+    const size_t n = items.size();
+    OccupiedSeconds used;
+    for (size_t i = 0; i < n; ++i) {
+        if (items.hasShot(i) && items.hasTarget(i)) used.insert(items.target[i]);
+    }
+
+    std::vector<int64_t> got;
+    size_t i = 0;
+    while (i < n) {
+        if (items.hasShot(i) || !items.hasTarget(i)) { i++; continue; }
+
+        const int64_t want = items.target[i];
+        size_t j = i + 1;
+        while (j < n && !items.hasShot(j) && items.target[j] == want) j++;
+
+        got.clear();
+        int64_t lo = used.prevFree(want), hi = used.nextFree(want);
+        while (got.size() < j - i) {
+            const int64_t t = (hi - want <= want - lo) ? hi : lo;
+            got.push_back(t);
+            used.insert(t);
+            if (hi == t) hi = used.nextFree(t + 1);
+            if (lo == t) lo = used.prevFree(t - 1);
+        }
+        std::sort(got.begin(), got.end());
+
+        for (size_t k = i; k < j; ++k) {
+            if (items.target[k] == got[k - i]) continue;
+            items.target[k] = got[k - i];
+            items.flags[k] |= kUniqueNearest;
+        }
+        i = j;
+    }
+}
+
+// ---------- plan targets ----------
+static void setShotAndOverrideTargets(ItemTable& items, const Options& opt) {
+    // pre-apply filename override for target (this can set target even if shot exists)
+    if (opt.enableFilenameOverrideForTarget) {
+        for (size_t i = 0; i < items.size(); ++i) applyFilenameOverrideForTarget(items, i, opt);
+    }
+
+    // For files that already have shot time and don't have a target yet, set target = shot
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (!items.hasTarget(i) && items.hasShot(i)) {
+            items.target[i] = items.shot[i];
+            items.reason[i] = (items.shotSource[i] == ShotSource::Filename)
+                ? TargetReason::ShotFromFilename : TargetReason::ShotFromMetadata;
+        }
+    }
+}
+
+// 去重兜底: nearest free second by default, or the old strictly increasing +1s/+2s bumps
+static void makeTargetsUnique(ItemTable& items, const Options& opt) {
+    if (opt.sequentialDedup) makeFilledTargetsStrictlyIncreasing(items, opt);
+    else allocateUniqueFilledTargets(items);
+}
+
+static void planTargets(ItemTable& items, const Options& opt) {
+    {
+        StageTimer timer(kStageOverride);
+        setShotAndOverrideTargets(items, opt);
+    }
+    {
+        StageTimer timer(kStageInterpolate);
+        // interpolate only for files that have NO shot (missing) AND target not set by filename override
+        inferMissingByInterpolation(items, opt);
+    }
+    StageTimer timer(kStageDedup);
+    makeTargetsUnique(items, opt);
+}
+
+// A segment is an anchor plus the files without shot after it, up to the next anchor (the first one may have
+// no anchor). Interpolation never looks past the next anchor's shot, so segments can be planned separately.
+template <class F>
+static void forEachSegment(const ItemTable& items, F&& f) {
+    size_t first = 0;
+    for (size_t i = 1; i <= items.size(); ++i) {
+        if (i == items.size() || items.hasShot(i)) {
+            f(first, i);
+            first = i;
+        }
+    }
+}
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) { h ^= p[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+static uint64_t fnv1aTime(uint64_t h, int64_t t) {
+    return fnv1a(h, &t, sizeof(t));
+}
+
+// Everything the targets of segment [first, last) depend on; call after setShotAndOverrideTargets().
+// nameOf(i) gives the index name of row i.
+template <class NameOf>
+static uint64_t segmentSignature(const ItemTable& items, const NameOf& nameOf, size_t first, size_t last) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = first; i < last; ++i) {
+        const uint8_t zero = 0, src = (uint8_t)items.shotSource[i];
+        const std::string_view name = nameOf(i);
+        h = fnv1a(h, name.data(), name.size());
+        h = fnv1a(h, &zero, 1);
+        h = fnv1aTime(h, items.mtime[i]);
+        h = fnv1aTime(h, items.shot[i]);
+        h = fnv1aTime(h, items.target[i]);
+        h = fnv1a(h, &src, 1);
+    }
+    return fnv1aTime(h, last < items.size() ? items.shot[last] : kNoTime);
+}
+
+// ---------- memory-mapped read-only file ----------
+struct MappedFile {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const fs::path& p) {
+        close();
+#ifdef _WIN32
+        file = CreateFileW(p.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER sz{};
+        if (!GetFileSizeEx(file, &sz) || sz.QuadPart == 0) { close(); return false; }
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) { close(); return false; }
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) { close(); return false; }
+        size = (size_t)sz.QuadPart;
+#else
+        int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); return false; }
+        void* m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) return false;
+        data = (const unsigned char*)m;
+        size = (size_t)st.st_size;
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// ---------- anchor index (persistent, memory-mapped) ----------
+// Every file of a library sorted by (mtime, path) with its shot time, written after a run.
+// Answers "what target would this new file get" with binary searches instead of a full rescan.
+// Records describe the files as the next full run would see them (synced mtime, written EXIF),
+// together with the targets that run would interpolate (before dedup) and the signatures of its
+// segments, so an incremental run only re-plans segments that changed.
+// Layout: header | root (padded to 8) | records[count] | segments[segmentCount] (sorted signatures)
+//         | byName[count] (record ids sorted by path) | names.
+// Native endianness; the index is a cache, rebuild it when moving between machines.
+static const char* const kAnchorIndexFileName = ".photo_timefix.idx";
+static constexpr char kAnchorIndexMagic[8] = { 'P', 'T', 'F', 'A', 'N', 'C', 'H', '1' };
+static constexpr uint32_t kAnchorIndexVersion = 3;
+
+struct AnchorIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    // options the index was built with; queries reuse them so they agree with the full run
+    int64_t anchorGapLimitDays;
+    int64_t oneSideStepSeconds;
+    int64_t filenameOverrideDays;
+    uint8_t oneSideStep;
+    uint8_t filenameFallbackForShot;
+    uint8_t filenameOverrideForTarget;
+    uint8_t xmpSidecar;    // shots include dates read from "<file>.xmp"
+    uint32_t rootLen;      // absolute library root (UTF-8), names are relative to it
+    uint64_t namesSize;
+    uint32_t segmentCount;
+    uint32_t reserved1;
+    uint64_t reserved2[2];
+};
+
+struct AnchorIndexRecord {
+    int64_t mtime;
+    int64_t shot;          // kNoTime: not an anchor
+    int64_t target;        // target the next run interpolates for this file (before dedup), kNoTime if none
+    int64_t appliedTarget; // target the file on disk was last synced to, kNoTime if never
+    int64_t ctime;         // Windows create/write times, kNoTime elsewhere
+    int64_t wtime;
+    uint64_t size;
+    uint64_t nameOffset;   // relative path (UTF-8) in the names blob
+    uint32_t nameLen;
+    int32_t prevAnchor;    // nearest anchor at or before this record, -1 if none
+    int32_t nextAnchor;    // nearest anchor at or after this record, count if none
+    uint8_t shotSource;
+    uint8_t reason;        // TargetReason of target
+    uint16_t reserved;
+};
+
+static_assert(sizeof(AnchorIndexHeader) == 80, "anchor index header layout");
+static_assert(sizeof(AnchorIndexRecord) == 80, "anchor index record layout");
+
+// records are read in place from the mapping, keep them 8-byte aligned
+static uint64_t paddedRootLen(uint64_t rootLen) { return (rootLen + 7) & ~uint64_t(7); }
+
+struct AnchorIndexEntry {
+    int64_t mtime = 0;
+    int64_t ctime = kNoTime;
+    int64_t wtime = kNoTime;
+    int64_t shot = kNoTime;
+    ShotSource shotSource = ShotSource::None;
+    int64_t appliedTarget = kNoTime;
+    uint64_t size = 0;
+    std::string name;
+};
+
+// Path of file relative to root, as used for the (mtime, path) order. Empty if file is not below root.
+// Sorting by the relative part is the same as sorting by the full path, since the root prefix is shared.
+static std::string_view indexNameFor(std::string_view rootUtf8, std::string_view fileUtf8) {
+    if (fileUtf8.size() <= rootUtf8.size() || fileUtf8.compare(0, rootUtf8.size(), rootUtf8) != 0) return {};
+    size_t pos = rootUtf8.size();
+    while (pos < fileUtf8.size() && (fileUtf8[pos] == '/' || fileUtf8[pos] == '\\')) pos++;
+    if (pos == rootUtf8.size() && !rootUtf8.empty() && rootUtf8.back() != '/' && rootUtf8.back() != '\\') return {};
+    return fileUtf8.substr(pos);
+}
+
+// Index names of the rows of a table, built on demand; a name stays valid until the next call.
+struct IndexNames {
+    const ItemTable& items;
+    std::string root;
+    mutable std::string buf{};
+
+    std::string_view operator()(size_t i) const { return indexNameFor(root, items.pathUtf8(i, buf)); }
+};
+
+static std::string absoluteUtf8(const fs::path& p) {
+    std::error_code ec;
+    fs::path a = fs::absolute(p, ec);
+    return pathToUtf8((ec ? p : a).lexically_normal());
+}
+
+// The file as the next full run will see it, given what this run applied.
+static AnchorIndexEntry indexEntryAfterRun(const ItemTable& items, size_t i, std::string_view name,
+    int64_t appliedTarget) {
+    AnchorIndexEntry e;
+    const uint8_t flags = items.flags[i];
+    if (flags & (kExifWritten | kFsTimesSynced)) {
+        // anything written changes times and size; take them from disk rather than guessing
+        const FileStat fst = statFile(itemPath(items, i));
+        e.mtime = fst.mtime;
+        e.size = fst.size;
+        e.ctime = fst.ctime;
+        e.wtime = fst.wtime;
+    }
+    else {
+        e.mtime = items.mtime[i];
+        e.size = items.fileSize[i];
+#ifdef _WIN32
+        e.ctime = items.ctime[i];
+        e.wtime = items.wtime[i];
+#endif
+    }
+    if ((flags & (kExifWritten | kXmpWritten)) && items.hasTarget(i)) {
+        e.shot = items.target[i];
+        e.shotSource = ShotSource::ExifOrXmp;
+    }
+    else {
+        e.shot = items.shot[i];
+        e.shotSource = items.shotSource[i];
+    }
+    e.appliedTarget = appliedTarget;
+    e.name = std::string(name);
+    return e;
+}
+
+static bool writeAnchorIndex(const fs::path& file, const std::string& rootUtf8,
+    std::vector<AnchorIndexEntry> entries, const Options& opt) {
+    std::sort(entries.begin(), entries.end(), [](const AnchorIndexEntry& a, const AnchorIndexEntry& b) {
+        if (a.mtime != b.mtime) return a.mtime < b.mtime;
+        return a.name < b.name;
+        });
+
+    // plan the library as the next run will see it
+    const uint32_t n = (uint32_t)entries.size();
+    ItemTable next;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (!next.add(entries[i].name)) return false;
+        next.mtime[i] = entries[i].mtime;
+#ifdef _WIN32
+        next.ctime[i] = entries[i].ctime;
+        next.wtime[i] = entries[i].wtime;
+#endif
+        next.shot[i] = entries[i].shot;
+        next.shotSource[i] = entries[i].shotSource;
+    }
+    const IndexNames names{ next, std::string() };
+    setShotAndOverrideTargets(next, opt);
+    std::vector<uint64_t> segments;
+    forEachSegment(next, [&](size_t first, size_t last) {
+        segments.push_back(segmentSignature(next, names, first, last));
+        });
+    std::sort(segments.begin(), segments.end());
+    segments.erase(std::unique(segments.begin(), segments.end()), segments.end());
+    inferMissingByInterpolation(next, opt);
+
+    std::vector<AnchorIndexRecord> records(n);
+    uint64_t namesSize = 0;
+    int32_t lastAnchor = -1;
+    for (uint32_t i = 0; i < n; ++i) {
+        AnchorIndexRecord& r = records[i];
+        r = {};
+        r.mtime = entries[i].mtime;
+        r.shot = entries[i].shot;
+        r.target = next.target[i];
+        r.appliedTarget = entries[i].appliedTarget;
+        r.ctime = entries[i].ctime;
+        r.wtime = entries[i].wtime;
+        r.size = entries[i].size;
+        r.nameOffset = namesSize;
+        r.nameLen = (uint32_t)entries[i].name.size();
+        namesSize += r.nameLen;
+        if (entries[i].shot != kNoTime) lastAnchor = (int32_t)i;
+        r.prevAnchor = lastAnchor;
+        r.shotSource = (uint8_t)entries[i].shotSource;
+        r.reason = (uint8_t)next.reason[i];
+    }
+    int32_t nextAnchor = (int32_t)n;
+    for (uint32_t i = n; i-- > 0;) {
+        if (entries[i].shot != kNoTime) nextAnchor = (int32_t)i;
+        records[i].nextAnchor = nextAnchor;
+    }
+
+    std::vector<uint32_t> byName(n);
+    for (uint32_t i = 0; i < n; ++i) byName[i] = i;
+    std::sort(byName.begin(), byName.end(), [&](uint32_t a, uint32_t b) { return entries[a].name < entries[b].name; });
+
+    AnchorIndexHeader h{};
+    std::memcpy(h.magic, kAnchorIndexMagic, sizeof(h.magic));
+    h.version = kAnchorIndexVersion;
+    h.count = n;
+    h.anchorGapLimitDays = opt.anchorGapLimitDays;
+    h.oneSideStepSeconds = opt.oneSideStepSeconds;
+    h.filenameOverrideDays = opt.filenameOverrideDays;
+    h.oneSideStep = opt.oneSideStep;
+    h.filenameFallbackForShot = opt.enableFilenameFallbackForShot;
+    h.filenameOverrideForTarget = opt.enableFilenameOverrideForTarget;
+    h.xmpSidecar = opt.xmpSidecar;
+    h.rootLen = (uint32_t)rootUtf8.size();
+    h.namesSize = namesSize;
+    h.segmentCount = (uint32_t)segments.size();
+
+    // write next to the old index and swap, so readers never see a half-written file
+    fs::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write((const char*)&h, sizeof(h));
+        out.write(rootUtf8.data(), (std::streamsize)rootUtf8.size());
+        const char pad[8] = {};
+        out.write(pad, (std::streamsize)(paddedRootLen(rootUtf8.size()) - rootUtf8.size()));
+        out.write((const char*)records.data(), (std::streamsize)(records.size() * sizeof(AnchorIndexRecord)));
+        out.write((const char*)segments.data(), (std::streamsize)(segments.size() * sizeof(uint64_t)));
+        out.write((const char*)byName.data(), (std::streamsize)(byName.size() * sizeof(uint32_t)));
+        for (const auto& e : entries) out.write(e.name.data(), (std::streamsize)e.name.size());
+        if (!out) return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if (ec) { fs::remove(tmp, ec); return false; }
+    return true;
+}
+
+struct AnchorIndexView {
+    MappedFile file;
+    const AnchorIndexHeader* header = nullptr;
+    const AnchorIndexRecord* records = nullptr;
+    const uint64_t* segments = nullptr;
+    const uint32_t* byName = nullptr;
+    const char* names = nullptr;
+    std::string root;
+
+    bool open(const fs::path& p) {
+        if (!file.open(p) || file.size < sizeof(AnchorIndexHeader)) return false;
+        header = (const AnchorIndexHeader*)file.data;
+        if (std::memcmp(header->magic, kAnchorIndexMagic, sizeof(header->magic)) != 0) return false;
+        if (header->version != kAnchorIndexVersion) return false;
+
+        const uint64_t n = header->count;
+        const uint64_t rootAt = sizeof(AnchorIndexHeader);
+        const uint64_t recordsAt = rootAt + paddedRootLen(header->rootLen);
+        const uint64_t segmentsAt = recordsAt + n * sizeof(AnchorIndexRecord);
+        const uint64_t byNameAt = segmentsAt + (uint64_t)header->segmentCount * sizeof(uint64_t);
+        const uint64_t namesAt = byNameAt + n * sizeof(uint32_t);
+        if (namesAt + header->namesSize != file.size) return false;
+
+        root.assign((const char*)file.data + rootAt, header->rootLen);
+        records = (const AnchorIndexRecord*)(file.data + recordsAt);
+        segments = (const uint64_t*)(file.data + segmentsAt);
+        byName = (const uint32_t*)(file.data + byNameAt);
+        names = (const char*)file.data + namesAt;
+        return true;
+    }
+
+    void close() {
+        file.close();
+        header = nullptr; records = nullptr; segments = nullptr; byName = nullptr; names = nullptr;
+    }
+
+    int64_t count() const { return header ? (int64_t)header->count : 0; }
+
+    std::string_view name(int64_t i) const {
+        return std::string_view(names + records[i].nameOffset, records[i].nameLen);
+    }
+
+    // record id of name, -1 if the file is not indexed
+    int64_t findByName(std::string_view key) const {
+        int64_t lo = 0, hi = count();
+        while (lo < hi) {
+            int64_t mid = lo + (hi - lo) / 2;
+            if (name(byName[mid]) < key) lo = mid + 1; else hi = mid;
+        }
+        return (lo < count() && name(byName[lo]) == key) ? (int64_t)byName[lo] : -1;
+    }
+
+    // first record not ordered before (mtime, key)
+    int64_t lowerBound(int64_t mtime, std::string_view key) const {
+        int64_t lo = 0, hi = count();
+        while (lo < hi) {
+            int64_t mid = lo + (hi - lo) / 2;
+            const AnchorIndexRecord& r = records[mid];
+            bool before = r.mtime != mtime ? r.mtime < mtime : name(mid) < key;
+            if (before) lo = mid + 1; else hi = mid;
+        }
+        return lo;
+    }
+
+    int64_t shot(int64_t i) const {
+        if (i < 0 || i >= count()) return kNoTime;
+        return records[i].shot;
+    }
+
+    bool hasSegment(uint64_t signature) const {
+        return header && std::binary_search(segments, segments + header->segmentCount, signature);
+    }
+
+    bool sameOptions(const Options& opt) const {
+        return header->anchorGapLimitDays == opt.anchorGapLimitDays
+            && header->oneSideStepSeconds == opt.oneSideStepSeconds
+            && header->filenameOverrideDays == opt.filenameOverrideDays
+            && (header->oneSideStep != 0) == opt.oneSideStep
+            && (header->filenameFallbackForShot != 0) == opt.enableFilenameFallbackForShot
+            && (header->filenameOverrideForTarget != 0) == opt.enableFilenameOverrideForTarget
+            && (header->xmpSidecar != 0) == opt.xmpSidecar;
+    }
+};
+
+static std::vector<AnchorIndexEntry> loadAnchorIndexEntries(const AnchorIndexView& idx) {
+    std::vector<AnchorIndexEntry> entries((size_t)idx.count());
+    for (int64_t i = 0; i < idx.count(); ++i) {
+        const AnchorIndexRecord& r = idx.records[i];
+        entries[i].mtime = r.mtime;
+        entries[i].ctime = r.ctime;
+        entries[i].wtime = r.wtime;
+        entries[i].shot = r.shot;
+        entries[i].shotSource = (ShotSource)r.shotSource;
+        entries[i].appliedTarget = r.appliedTarget;
+        entries[i].size = r.size;
+        entries[i].name = std::string(idx.name(i));
+    }
+    return entries;
+}
+
+// ---------- incremental re-planning ----------
+// Take shot time from the previous run's index if the file did not change since.
+// Needs the indexRecord column; the record also tells what was applied (previousAppliedTarget).
+static bool reuseShotFromIndex(const AnchorIndexView& prev, std::string_view name, ItemTable& items, size_t i) {
+    int64_t rec = prev.findByName(name);
+    if (rec < 0) return false;
+    const AnchorIndexRecord& r = prev.records[rec];
+    if (r.mtime != items.mtime[i] || r.size != items.fileSize[i]) return false;
+
+    items.shot[i] = r.shot;
+    items.shotSource[i] = (ShotSource)r.shotSource;
+    items.indexRecord[i] = (int32_t)rec;
+    return true;
+}
+
+// target the file on disk was synced to by a previous run, kNoTime if unknown
+static int64_t previousAppliedTarget(const ItemTable& items, size_t i, const AnchorIndexView& prev) {
+    if (items.indexRecord.empty() || items.indexRecord[i] < 0) return kNoTime;
+    return prev.records[items.indexRecord[i]].appliedTarget;
+}
+
+struct ReplanStats {
+    size_t segments = 0;
+    size_t replanned = 0;
+};
+
+// Same result as inferMissingByInterpolation(), but segments found unchanged in the previous run's index take
+// their interpolated targets from there. Dedup runs over all targets afterwards.
+static ReplanStats replanChangedSegments(ItemTable& items, const IndexNames& names,
+    const AnchorIndexView& prev, const Options& opt) {
+    ReplanStats st;
+    forEachSegment(items, [&](size_t first, size_t last) {
+        st.segments++;
+        bool reuse = prev.hasSegment(segmentSignature(items, names, first, last));
+        for (size_t i = first; reuse && i < last; ++i) reuse = items.indexRecord[i] >= 0;
+        if (reuse) {
+            for (size_t i = first; i < last; ++i) {
+                if (items.hasShot(i)) continue;
+                const AnchorIndexRecord& r = prev.records[items.indexRecord[i]];
+                items.target[i] = r.target;
+                items.reason[i] = (TargetReason)r.reason;
+            }
+            return;
+        }
+        st.replanned++;
+        inferMissingByInterpolation(items, opt, first, last);
+        });
+    return st;
+}
+
+static void optionsFromIndex(const AnchorIndexHeader& h, Options& opt) {
+    opt.anchorGapLimitDays = h.anchorGapLimitDays;
+    opt.oneSideStepSeconds = h.oneSideStepSeconds;
+    opt.filenameOverrideDays = h.filenameOverrideDays;
+    opt.oneSideStep = h.oneSideStep != 0;
+    opt.enableFilenameFallbackForShot = h.filenameFallbackForShot != 0;
+    opt.enableFilenameOverrideForTarget = h.filenameOverrideForTarget != 0;
+    opt.xmpSidecar = h.xmpSidecar != 0;
+}
+
+// Target row i would get from a full run over the indexed library plus this file.
+// The row must have mtime and shot filled (fillShotTime); sets its target and reason.
+static void queryAnchorIndex(const AnchorIndexView& idx, std::string_view name, ItemTable& items, size_t i,
+    const Options& opt) {
+    // same rule order as main(): filename override, then own shot, then gap fill
+    if (opt.enableFilenameOverrideForTarget) applyFilenameOverrideForTarget(items, i, opt);
+    if (!items.hasTarget(i) && items.hasShot(i)) {
+        items.target[i] = items.shot[i];
+        items.reason[i] = (items.shotSource[i] == ShotSource::Filename)
+            ? TargetReason::ShotFromFilename : TargetReason::ShotFromMetadata;
+    }
+    if (items.hasTarget(i)) return;
+
+    // an already indexed copy of this file (maybe with an older mtime) is replaced by the new one
+    const int64_t n = idx.count();
+    const int64_t old = idx.findByName(name);
+    const int64_t p = idx.lowerBound(items.mtime[i], name);
+
+    auto isOld = [&](int64_t r) { return old >= 0 && r == old; };
+    int64_t prevA = p > 0 ? idx.records[p - 1].prevAnchor : -1;
+    if (prevA >= 0 && isOld(prevA)) prevA = prevA > 0 ? idx.records[prevA - 1].prevAnchor : -1;
+    int64_t nextA = p < n ? idx.records[p].nextAnchor : n;
+    if (nextA < n && isOld(nextA)) nextA = nextA + 1 < n ? idx.records[nextA + 1].nextAnchor : n;
+
+    // gap members are the records strictly between the anchors, minus the replaced one, plus this file
+    const bool oldInGap = old > prevA && old < nextA;
+    const bool oldBefore = old > prevA && old < p;
+    const long long m = (nextA - prevA - 1) - (oldInGap ? 1 : 0) + 1;
+    const long long k = (p - prevA - 1) - (oldBefore ? 1 : 0) + 1;
+
+    TargetReason reason = TargetReason::None;
+    int64_t t = gapFillTarget(idx.shot(prevA), idx.shot(nextA), m, k, opt, reason);
+    if (t != kNoTime) {
+        items.target[i] = t;
+        items.reason[i] = reason;
+    }
+}
+
+// nearest index file in the folders above file
+static fs::path findAnchorIndexFor(const fs::path& file) {
+    std::error_code ec;
+    fs::path dir = fs::absolute(file, ec).parent_path();
+    while (!dir.empty()) {
+        fs::path candidate = dir / kAnchorIndexFileName;
+        if (fs::is_regular_file(candidate, ec)) return candidate;
+        if (dir == dir.parent_path()) break;
+        dir = dir.parent_path();
+    }
+    return {};
+}
+
+static int runIndexQuery(const fs::path& root, Options& opt) {
+    fs::path indexFile = opt.indexPath;
+    if (indexFile.empty() && !root.empty()) indexFile = root / kAnchorIndexFileName;
+    if (indexFile.empty()) indexFile = findAnchorIndexFor(opt.queryFile);
+
+    AnchorIndexView idx;
+    if (indexFile.empty() || !idx.open(indexFile)) {
+        std::cout << "Anchor index not found or invalid: " << indexFile << "\n";
+        return 1;
+    }
+    optionsFromIndex(*idx.header, opt);
+
+    std::error_code ec;
+    if (!fs::is_regular_file(opt.queryFile, ec)) {
+        std::cout << "Query file not found: " << opt.queryFile << "\n";
+        return 1;
+    }
+    const std::string queryUtf8 = absoluteUtf8(opt.queryFile);
+    const std::string name(indexNameFor(idx.root, queryUtf8));
+    if (name.empty()) {
+        std::cout << "Query file is not inside the indexed folder " << idx.root << "\n";
+        return 1;
+    }
+
+    ItemTable items;
+    addItem(items, opt.queryFile);
+    fillShotTime(items, 0, opt);
+    queryAnchorIndex(idx, name, items, 0, opt);
+
+    std::cout << (items.hasShot(0) ? "[OK]   " : "[FILL] ") << opt.queryFile << "\n";
+    if (items.hasTarget(0)) {
+        std::cout << "       target: " << formatLocalTime((std::time_t)items.target[0])
+            << "   (" << reasonText(items.reason[0], items.flags[0]) << ")\n";
+    }
+    else {
+        std::cout << "       no target time inferred (no anchors in index)\n";
+    }
+    std::cout << "       mtime : " << formatLocalTime((std::time_t)items.mtime[0]) << "\n";
+
+    if (opt.indexUpdate) {
+        std::vector<AnchorIndexEntry> entries = loadAnchorIndexEntries(idx);
+        std::string rootUtf8 = idx.root;
+        idx.close();
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+            [&](const AnchorIndexEntry& e) { return e.name == name; }), entries.end());
+        entries.push_back(indexEntryAfterRun(items, 0, name, kNoTime));
+        if (!writeAnchorIndex(indexFile, rootUtf8, std::move(entries), opt)) {
+            std::cout << "Anchor index update failed: " << indexFile << "\n";
+            return 1;
+        }
+        std::cout << "Anchor index updated: " << indexFile << "\n";
+    }
+    return 0;
+}
+
+// ---------- I/O throttling ----------
+// For storage shared with other services: a lower I/O priority (--ioprio) and caps on files, bytes read and
+// bytes written per second for all threads together (token buckets). With --latency-target the caps go down
+// while files take longer than that and back up when the device is fast again.
+
+// I/O priority of the calling thread. Linux: ioprio class idle (only when nobody else uses the disk) or
+// best-effort with a level; Windows: background mode for idle.
+static bool setThreadIoPriority(const Options& opt) {
+    if (opt.ioPriorityClass == 0) return true;
+#if defined(__linux__)
+    const int level = opt.ioPriorityClass == 3 ? 0 : opt.ioPriorityLevel;
+    return syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS, 0 = this thread */, 0, (opt.ioPriorityClass << 13) | level) == 0;
+#elif defined(_WIN32)
+    if (opt.ioPriorityClass != 3) return true; // best-effort is the normal class
+    return SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != 0;
+#else
+    return false;
+#endif
+}
+
+// Tokens per second with up to one second of burst. Takers may run into debt, which the next ones wait off.
+struct TokenBucket {
+    double rate = 0;    // 0 = unlimited
+    double tokens = 0;
+
+    void refill(double seconds) { if (rate > 0) tokens = std::min(rate, tokens + rate * seconds); }
+    void take(double n) { if (rate > 0) tokens -= n; }
+    double waitSeconds() const { return rate > 0 && tokens < 0 ? -tokens / rate : 0; }
+};
+
+struct IoThrottle {
+    using Clock = std::chrono::steady_clock;
+
+    double maxFiles, maxRead, maxWrite;     // configured caps per second (0 = none)
+    double latencyTarget;                   // seconds per file (0 = fixed caps)
+    std::mutex mutex;
+    TokenBucket files, readBytes, writtenBytes;
+    Clock::time_point last, lastAdapt;
+    uint64_t ioRead = 0, ioWritten = 0;
+    bool ioCounters = false;
+    double scale = 1;                       // share of the caps in use, lowered by latency
+    double latency = 0;                     // moving average of the seconds per file
+    size_t finished = 0, finishedAtAdapt = 0;
+    double waited = 0;                      // seconds slept, all threads
+
+    explicit IoThrottle(const Options& opt)
+        : maxFiles(opt.maxFilesPerSec), maxRead(opt.maxReadBytesPerSec), maxWrite(opt.maxWriteBytesPerSec),
+        latencyTarget(opt.latencyTargetMs / 1000), last(Clock::now()), lastAdapt(last) {
+        ioCounters = (maxRead > 0 || maxWrite > 0) && processIoBytes(ioRead, ioWritten);
+        setRates();
+    }
+
+    bool active() const { return maxFiles > 0 || maxRead > 0 || maxWrite > 0 || latencyTarget > 0; }
+
+    void setRates() {
+        files.rate = maxFiles * scale;
+        readBytes.rate = maxRead * scale;
+        writtenBytes.rate = maxWrite * scale;
+    }
+
+    // before each file: charges the bytes moved since the last call, sleeps while a cap is used up
+    void beforeFile() {
+        if (!active()) return;
+        double wait = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const Clock::time_point now = Clock::now();
+            const double dt = std::chrono::duration<double>(now - last).count();
+            last = now;
+            files.refill(dt);
+            readBytes.refill(dt);
+            writtenBytes.refill(dt);
+            uint64_t r = 0, w = 0;
+            if (ioCounters && processIoBytes(r, w)) {
+                readBytes.take((double)(r - ioRead));
+                writtenBytes.take((double)(w - ioWritten));
+                ioRead = r;
+                ioWritten = w;
+            }
+            files.take(1);
+            wait = std::max({ files.waitSeconds(), readBytes.waitSeconds(), writtenBytes.waitSeconds() });
+            waited += wait;
+        }
+        if (wait > 0) {
+            TraceSpan span("throttle wait");
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+    }
+
+    // after each file with the seconds it took: once a second, scale the caps to --latency-target
+    void afterFile(double seconds) {
+        if (latencyTarget <= 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        latency = finished++ == 0 ? seconds : latency * 0.9 + seconds * 0.1;
+        const Clock::time_point now = Clock::now();
+        const double dt = std::chrono::duration<double>(now - lastAdapt).count();
+        if (dt < 1) return;
+        if (latency > latencyTarget) {
+            // no caps given: start from the file rate reached so far
+            if (maxFiles <= 0 && maxRead <= 0 && maxWrite <= 0) maxFiles = std::max(1.0, (finished - finishedAtAdapt) / dt);
+            scale = std::max(0.01, scale * 0.7);
+        }
+        else if (latency < latencyTarget / 2) {
+            scale = std::min(1.0, scale * 1.2);
+        }
+        lastAdapt = now;
+        finishedAtAdapt = finished;
+        setRates();
+    }
+
+    // beforeFile(), fn(), afterFile()
+    template <class Fn>
+    void run(Fn&& fn) {
+        if (!active()) { fn(); return; }
+        beforeFile();
+        const Clock::time_point start = Clock::now();
+        fn();
+        afterFile(std::chrono::duration<double>(Clock::now() - start).count());
+    }
+};
+
+// ---------- progress ----------
+// Live progress for long runs without a per-file report. The stages count their files in relaxed atomics;
+// a reporter thread samples them a few times a second and prints files/s, MB/s read from storage and the
+// stage ETA to stderr, as a status line on a terminal (--progress) and/or as JSON lines every N seconds
+// (--progress-json N) for job schedulers. The counting threads never wait for it.
+enum class Stage : uint8_t {
+    Scan,
+    Read,
+    Plan,
+    Apply
+};
+
+static const char* stageName(Stage s) {
+    switch (s) {
+    case Stage::Scan: return "scan";
+    case Stage::Read: return "read";
+    case Stage::Plan: return "plan";
+    case Stage::Apply: return "apply";
+    }
+    return "";
+}
+
+struct Progress {
+    static constexpr size_t kStages = 4;
+    std::atomic<uint64_t> done[kStages] = {};
+    std::atomic<uint64_t> total[kStages] = {};     // 0: not known (scan)
+    std::atomic<uint8_t> stage{ (uint8_t)Stage::Scan };
+
+    void enter(Stage s, uint64_t files = 0) {
+        total[(size_t)s].store(files, std::memory_order_relaxed);
+        stage.store((uint8_t)s, std::memory_order_release);
+    }
+    void add(Stage s, uint64_t n = 1) { done[(size_t)s].fetch_add(n, std::memory_order_relaxed); }
+    std::atomic<uint64_t>* counter(Stage s) { return &done[(size_t)s]; }
+};
+
+static bool stderrIsTerminal() {
+#ifdef _WIN32
+    return GetFileType(GetStdHandle(STD_ERROR_HANDLE)) == FILE_TYPE_CHAR;
+#else
+    return isatty(2) != 0;
+#endif
+}
+
+static std::string formatDuration(double seconds) {
+    const long long s = (long long)std::max(0.0, seconds);
+    std::ostringstream oss;
+    oss << s / 3600 << ':' << std::setw(2) << std::setfill('0') << s / 60 % 60 << ':' << std::setw(2) << s % 60;
+    return oss.str();
+}
+
+struct ProgressReporter {
+    using Clock = std::chrono::steady_clock;
+    static constexpr auto kTick = std::chrono::milliseconds(250);
+
+    Progress& progress;
+    bool live;
+    double jsonEvery;                   // seconds, 0 = off
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+    std::thread thread;
+
+    ProgressReporter(Progress& progress_, bool live_, double jsonEvery_)
+        : progress(progress_), live(live_), jsonEvery(jsonEvery_) {
+        if (live || jsonEvery > 0) thread = std::thread([this] { run(); mergeThreadStats(); });
+    }
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+    ~ProgressReporter() { finish(); }
+
+    // prints the last state and ends the status line; call before printing the summary
+    void finish() {
+        if (!thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    void run() {
+        const Clock::time_point start = Clock::now();
+        Clock::time_point last = start, lastJson = start;
+        Stage stage = (Stage)progress.stage.load(std::memory_order_acquire);
+        uint64_t lastDone = 0, ioRead = 0, ioWritten = 0;
+        const bool io = processIoBytes(ioRead, ioWritten);
+        double rate = -1, mbRate = 0;   // moving averages, rate < 0: no sample yet
+        bool stopping = false;
+        while (!stopping) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stopping = cv.wait_for(lock, kTick, [&] { return stop; });
+            }
+            const Clock::time_point now = Clock::now();
+            const Stage s = (Stage)progress.stage.load(std::memory_order_acquire);
+            if (s != stage) {
+                if (live) line(stage, start, now, rate, mbRate, true);
+                stage = s;
+                lastDone = 0;
+                rate = -1;
+            }
+            const uint64_t done = progress.done[(size_t)stage].load(std::memory_order_relaxed);
+            const double dt = std::chrono::duration<double>(now - last).count();
+            if (dt > 0) {
+                const double r = (double)(done - lastDone) / dt;
+                rate = rate < 0 ? r : rate * 0.7 + r * 0.3;
+                uint64_t rd = 0, wr = 0;
+                if (io && processIoBytes(rd, wr)) {
+                    mbRate = mbRate * 0.7 + (double)(rd - ioRead) / dt / 1e6 * 0.3;
+                    ioRead = rd;
+                }
+            }
+            last = now;
+            lastDone = done;
+            if (live) line(stage, start, now, rate, mbRate, stopping);
+            if (jsonEvery > 0 && (stopping || std::chrono::duration<double>(now - lastJson).count() >= jsonEvery)) {
+                json(stage, start, now, rate, mbRate);
+                lastJson = now;
+            }
+        }
+    }
+
+    double eta(Stage s, double rate) const {
+        const uint64_t total = progress.total[(size_t)s].load(std::memory_order_relaxed);
+        const uint64_t done = progress.done[(size_t)s].load(std::memory_order_relaxed);
+        if (total == 0 || rate <= 0) return -1;
+        return done >= total ? 0 : (double)(total - done) / rate;
+    }
+
+    void line(Stage s, Clock::time_point start, Clock::time_point now, double rate, double mbRate, bool last) {
+        const uint64_t total = progress.total[(size_t)s].load(std::memory_order_relaxed);
+        std::ostringstream oss;
+        oss << '\r' << '[' << stageName(s) << "] " << progress.done[(size_t)s].load(std::memory_order_relaxed);
+        if (total) oss << '/' << total;
+        oss << " files  " << std::fixed << std::setprecision(0) << std::max(0.0, rate) << " files/s  "
+            << std::setprecision(1) << mbRate << " MB/s  elapsed "
+            << formatDuration(std::chrono::duration<double>(now - start).count());
+        const double e = eta(s, rate);
+        if (e >= 0) oss << "  ETA " << formatDuration(e);
+        oss << "\x1b[K" << (last ? "\n" : "");
+        const std::string text = oss.str();
+        std::fwrite(text.data(), 1, text.size(), stderr);
+        std::fflush(stderr);
+    }
+
+    void json(Stage s, Clock::time_point start, Clock::time_point now, double rate, double mbRate) {
+        std::ostringstream oss;
+        if (live) oss << "\r\x1b[K"; // the status line is printed again on the next tick
+        oss << std::fixed << std::setprecision(1)
+            << "{\"progress\":{\"stage\":\"" << stageName(s) << "\",\"done\":" << progress.done[(size_t)s].load(std::memory_order_relaxed)
+            << ",\"total\":" << progress.total[(size_t)s].load(std::memory_order_relaxed)
+            << ",\"files_per_sec\":" << std::max(0.0, rate) << ",\"read_mb_per_sec\":" << mbRate
+            << ",\"elapsed_seconds\":" << std::chrono::duration<double>(now - start).count();
+        const double e = eta(s, rate);
+        if (e >= 0) oss << ",\"eta_seconds\":" << e;
+        oss << "}}\n";
+        const std::string text = oss.str();
+        std::fwrite(text.data(), 1, text.size(), stderr);
+        std::fflush(stderr);
+    }
+};
+
+// ---------- parallel apply ----------
+// Device (volume) a path lives on; writes are limited per device.
+static uint64_t deviceIdOf(const fs::path& p) {
+#ifdef _WIN32
+    wchar_t volume[MAX_PATH + 1] = {};
+    DWORD serial = 0;
+    if (GetVolumePathNameW(p.wstring().c_str(), volume, MAX_PATH + 1)
+        && GetVolumeInformationW(volume, nullptr, 0, &serial, nullptr, nullptr, nullptr, 0)) {
+        return serial;
+    }
+    return 0;
+#else
+    struct stat st {};
+    return ::stat(p.c_str(), &st) == 0 ? (uint64_t)st.st_dev : 0;
+#endif
+}
+
+// Linux only: spinning disk (seeks make parallel writes slower, not faster)
+static bool isRotationalDevice(uint64_t dev) {
+#ifdef __linux__
+    const std::string base = "/sys/dev/block/" + std::to_string(major((dev_t)dev)) + ":" + std::to_string(minor((dev_t)dev));
+    for (const char* rel : { "/queue/rotational", "/../queue/rotational" }) { // whole disk, or a partition of it
+        std::ifstream in(base + rel);
+        int v = 0;
+        if (in >> v) return v == 1;
+    }
+#else
+    (void)dev;
+#endif
+    return false;
+}
+
+static int deviceJobsFor(uint64_t dev, const Options& opt) {
+    for (const auto& dj : opt.deviceJobs) {
+        if (deviceIdOf(dj.first) == dev) return std::max(1, dj.second);
+    }
+    return isRotationalDevice(dev) ? 1 : std::max(1, opt.applyJobs);
+}
+
+// ---------- latency histograms (--stats) ----------
+// Time of the metadata read and of the apply of each file, per format (file extension) and per device, in
+// HDR-style histograms: exact below 16 us, then 16 linear sub-buckets per power of two (at most 6.25% off),
+// up to 2^36 us. The slowest files are kept in a bounded min-heap with their read and apply times.
+struct LatencyHistogram {
+    static constexpr int kSub = 16;
+    static constexpr int kBuckets = kSub + (36 - 4) * kSub;
+    uint64_t counts[kBuckets] = {};
+    uint64_t count = 0, maxUs = 0;
+    double sumUs = 0;
+
+    static int bucketOf(uint64_t us) {
+        if (us < (uint64_t)kSub) return (int)us;
+        const int top = OccupiedSeconds::highestBit(us); // >= 4
+        return std::min(kSub + (top - 4) * kSub + (int)((us >> (top - 4)) - kSub), kBuckets - 1);
+    }
+    // middle of bucket b
+    static double valueOf(int b) {
+        if (b < kSub) return b;
+        const int shift = (b - kSub) / kSub;
+        const uint64_t low = (uint64_t)(kSub + (b - kSub) % kSub) << shift;
+        return (double)low + (double)((1ULL << shift) - 1) / 2;
+    }
+
+    void record(double seconds) {
+        const uint64_t us = (uint64_t)(std::max(0.0, seconds) * 1e6);
+        counts[bucketOf(us)]++;
+        count++;
+        sumUs += (double)us;
+        maxUs = std::max(maxUs, us);
+    }
+
+    double percentileUs(double q) const {
+        const uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(q * (double)count));
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += counts[b];
+            if (seen >= rank) return std::min(valueOf(b), (double)maxUs);
+        }
+        return (double)maxUs;
+    }
+};
+
+enum LatencyStage : uint8_t { kLatencyRead, kLatencyApply, kLatencyStageCount };
+
+struct SlowFile {
+    double read = 0, apply = 0;  // seconds
+    std::string path, format;
+
+    double total() const { return read + apply; }
+};
+
+// "jpg", "tiff", "mp4", ...: the lower-case extension, with the spelling variants merged
+static std::string latencyFormatOf(std::string_view name) {
+    const size_t dot = name.find_last_of('.');
+    if (dot == std::string_view::npos || dot + 1 == name.size()) return "none";
+    std::string ext(name.substr(dot + 1));
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    if (ext == "jpeg") return "jpg";
+    if (ext == "tif") return "tiff";
+    return ext;
+}
+
+// Linux "major:minor", elsewhere the volume serial number
+static std::string deviceLabel(uint64_t dev) {
+    std::ostringstream s;
+#if defined(__linux__)
+    s << major((dev_t)dev) << ":" << minor((dev_t)dev);
+#else
+    s << std::hex << dev;
+#endif
+    return s.str();
+}
+
+// Shared by the read loop and the apply workers.
+struct LatencyStats {
+    std::mutex mutex;
+    std::unordered_map<std::string, LatencyHistogram> byFormat[kLatencyStageCount];
+    std::unordered_map<uint64_t, LatencyHistogram> byDevice[kLatencyStageCount];
+    size_t slowestLimit;
+    std::vector<SlowFile> slowest;                      // min-heap on total()
+    std::unordered_map<uint32_t, uint64_t> deviceOfDir; // read stage (main thread only)
+
+    explicit LatencyStats(size_t slowestLimit_) : slowestLimit(slowestLimit_) {}
+
+    // device of row i, one stat per folder; main thread only
+    uint64_t readDevice(const ItemTable& items, size_t i) {
+        const uint32_t dir = items.paths.dirOf(items.pathId[i]);
+        auto it = deviceOfDir.find(dir);
+        if (it == deviceOfDir.end()) {
+            const std::string& text = *items.paths.dirs[dir];
+            it = deviceOfDir.emplace(dir, deviceIdOf(pathFromUtf8(text.empty() ? std::string(".") : text))).first;
+        }
+        return it->second;
+    }
+
+    void record(LatencyStage stage, const ItemTable& items, size_t i, uint64_t device, double seconds) {
+        std::string format = latencyFormatOf(items.fileName(i));
+        std::lock_guard<std::mutex> lock(mutex);
+        byFormat[stage][format].record(seconds);
+        byDevice[stage][device].record(seconds);
+    }
+
+    // row i is done; the path is only built when the file makes it into the slowest
+    void offer(const ItemTable& items, size_t i, double read, double apply) {
+        const auto later = [](const SlowFile& a, const SlowFile& b) { return a.total() > b.total(); };
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slowestLimit == 0 || (slowest.size() >= slowestLimit && read + apply <= slowest.front().total())) return;
+        if (slowest.size() >= slowestLimit) {
+            std::pop_heap(slowest.begin(), slowest.end(), later);
+            slowest.pop_back();
+        }
+        std::string buf;
+        slowest.push_back(SlowFile{ read, apply, std::string(items.pathUtf8(i, buf)), latencyFormatOf(items.fileName(i)) });
+        std::push_heap(slowest.begin(), slowest.end(), later);
+    }
+
+    // rows that were not applied (applied: ascending rows that were) are done after their read
+    void offerNotApplied(const ItemTable& items, const std::vector<uint32_t>& applied) {
+        size_t k = 0;
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (k < applied.size() && applied[k] == i) { k++; continue; }
+            offer(items, i, items.readSeconds.empty() ? 0 : items.readSeconds[i], 0);
+        }
+    }
+};
+
+// ---------- apply journal ----------
+// Write-ahead record of what apply may change, so a run can be undone with --rollback, also after a crash.
+// A file is only touched once its record is on disk; records are synced in groups (--journal-sync N), not
+// one by one. Files are recorded by full path (path ids only hold within a run). Rolling back is
+// idempotent: records of files the run never reached restore what they already have.
+static constexpr char kApplyJournalMagic[8] = { 'P', 'T', 'F', 'J', 'R', 'N', 'L', '1' };
+static constexpr uint32_t kApplyJournalVersion = 2;
+#ifdef _WIN32
+static constexpr uint32_t kApplyJournalPlatform = 1;
+#else
+static constexpr uint32_t kApplyJournalPlatform = 0;
+#endif
+
+struct ApplyJournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t platform;     // meaning of the saved times: 0 POSIX, 1 Windows
+    uint64_t reserved;
+};
+
+// ApplyJournalRecord::actions bits
+enum JournalAction : uint8_t {
+    kJournalExif = 1,      // apply may add EXIF dates equal to target
+    kJournalXmp = 2,       // apply may add sidecar dates equal to target
+    kJournalTimes = 4,     // apply may set the file times
+    kJournalHasTimes = 8,  // times[] hold the file's times before apply
+};
+
+struct ApplyJournalRecord {
+    uint64_t checksum;     // FNV-1a of the rest of the record and the path; a torn last record fails it
+    int64_t target;
+    int64_t times[3];      // POSIX: atime, mtime (ns); Windows: create, access, write (FILETIME)
+    uint32_t pathLen;      // full path (UTF-8) follows the record
+    uint8_t actions;       // JournalAction bits
+    uint8_t sidecarExisted;
+    uint8_t missingDates;  // kJournalExif: MissingDate bits, the EXIF dates the file did not have before apply
+    uint8_t reserved;
+};
+
+static_assert(sizeof(ApplyJournalHeader) == 24, "apply journal header layout");
+static_assert(sizeof(ApplyJournalRecord) == 48, "apply journal record layout");
+
+static uint64_t journalChecksum(const ApplyJournalRecord& r, const char* path) {
+    uint64_t h = fnv1a(1469598103934665603ULL, (const char*)&r + sizeof(r.checksum), sizeof(r) - sizeof(r.checksum));
+    return fnv1a(h, path, r.pathLen);
+}
+
+// file times at full precision, as the journal saves and restores them
+static bool readNativeTimes(const fs::path& p, int64_t times[3]) {
+#ifdef _WIN32
+    HANDLE h = CreateFileW(p.wstring().c_str(), FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    FILETIME ft[3]{};
+    BOOL ok = GetFileTime(h, &ft[0], &ft[1], &ft[2]);
+    CloseHandle(h);
+    if (!ok) return false;
+    for (int k = 0; k < 3; ++k) times[k] = (int64_t)(((uint64_t)ft[k].dwHighDateTime << 32) | ft[k].dwLowDateTime);
+#else
+    struct stat st {};
+    if (::stat(p.c_str(), &st) != 0) return false;
+    times[0] = (int64_t)st.st_atim.tv_sec * 1000000000 + st.st_atim.tv_nsec;
+    times[1] = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    times[2] = 0;
+#endif
+    return true;
+}
+
+static bool restoreNativeTimes(const fs::path& p, const int64_t times[3]) {
+#ifdef _WIN32
+    FILETIME ft[3];
+    for (int k = 0; k < 3; ++k) {
+        ft[k].dwLowDateTime = (DWORD)((uint64_t)times[k] & 0xFFFFFFFF);
+        ft[k].dwHighDateTime = (DWORD)((uint64_t)times[k] >> 32);
+    }
+    HANDLE h = CreateFileW(p.wstring().c_str(), FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    BOOL ok = SetFileTime(h, &ft[0], &ft[1], &ft[2]);
+    CloseHandle(h);
+    return ok != 0;
+#else
+    timespec ts[2];
+    for (int k = 0; k < 2; ++k) {
+        ts[k].tv_sec = (time_t)(times[k] / 1000000000);
+        ts[k].tv_nsec = (long)(times[k] % 1000000000);
+        if (ts[k].tv_nsec < 0) { ts[k].tv_nsec += 1000000000; ts[k].tv_sec--; }
+    }
+    return utimensat(AT_FDCWD, p.c_str(), ts, 0) == 0;
+#endif
+}
+
+// what applyFile() may change for row i
+static uint8_t journalActions(const ItemTable& items, size_t i, const Options& opt) {
+    uint8_t actions = 0;
+    if (opt.writeExifIfMissing && items.shotSource[i] != ShotSource::ExifOrXmp) {
+        actions |= opt.xmpSidecar ? kJournalXmp : kJournalExif;
+    }
+    if (opt.syncFileTimes) actions |= kJournalTimes;
+    return actions;
+}
+
+struct ApplyJournal {
+    RandomAccessFile file;
+    uint64_t end = 0;
+    std::string pending;     // records not on disk yet
+    size_t pendingCount = 0;
+    size_t syncEvery = 256;
+
+    bool create(const fs::path& p, size_t syncEvery_) {
+        syncEvery = std::max<size_t>(1, syncEvery_);
+        ApplyJournalHeader h{};
+        std::memcpy(h.magic, kApplyJournalMagic, sizeof(h.magic));
+        h.version = kApplyJournalVersion;
+        h.platform = kApplyJournalPlatform;
+        if (!file.create(p) || !file.writeAt(0, &h, sizeof(h)) || !file.sync()) return false;
+        end = sizeof(h);
+#ifndef _WIN32
+        // the new name must survive a crash as well
+        const fs::path dir = p.parent_path().empty() ? fs::path(".") : p.parent_path();
+        int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) { fsync(dfd); ::close(dfd); }
+#endif
+        return true;
+    }
+
+    // missingDates: ItemTable::missingDates; read here for files the read stage did not look at
+    void add(const fs::path& path, int64_t target, uint8_t actions, uint8_t missingDates) {
+        const std::string utf8 = pathToUtf8(path);
+        ApplyJournalRecord r{};
+        r.target = target;
+        if (readNativeTimes(path, r.times)) actions |= kJournalHasTimes;
+        r.actions = actions;
+        if ((actions & kJournalExif) && !(missingDates & kMissingDatesKnown)) readShotTimeFromMetadata(path, &missingDates);
+        r.missingDates = (actions & kJournalExif) ? (uint8_t)(missingDates & ~kMissingDatesKnown) : 0;
+        std::error_code ec;
+        r.sidecarExisted = (actions & kJournalXmp) && fs::exists(xmpSidecarPath(path), ec);
+        r.pathLen = (uint32_t)utf8.size();
+        r.checksum = journalChecksum(r, utf8.data());
+        pending.append((const char*)&r, sizeof(r));
+        pending.append(utf8);
+        pending.append((8 - utf8.size() % 8) % 8, '\0');
+        pendingCount++;
+    }
+
+    // writes the pending records and syncs them once; on failure they stay pending and end is unchanged
+    bool commit() {
+        if (pending.empty()) return true;
+        if (!file.writeAt(end, pending.data(), pending.size()) || !file.sync()) return false;
+        end += pending.size();
+        pending.clear();
+        pendingCount = 0;
+        return true;
+    }
+};
+
+// Removes the dates apply added (equal to t): in a sidecar the XMP dates, else the EXIF dates in missingDates
+// (MissingDate bits: the ones the file did not have). True if the file changed.
+static bool removeAddedDates(const fs::path& file, std::time_t t, bool sidecar, uint8_t missingDates, bool verbose,
+    std::ostream& log) {
+    try {
+        STAT_ADD(kStatExiv2Opens, 1);
+        auto img = Exiv2::ImageFactory::open(pathToUtf8(file));
+        if (!img.get()) return false;
+
+        img->readMetadata();
+        bool changed = false;
+        if (sidecar) {
+            auto& xmp = img->xmpData();
+            const std::string s = toXmpDateString(t);
+            for (const char* k : { "Xmp.xmp.CreateDate", "Xmp.exif.DateTimeOriginal", "Xmp.photoshop.DateCreated" }) {
+                auto it = xmp.findKey(Exiv2::XmpKey(k));
+                if (it != xmp.end() && it->toString() == s) { xmp.erase(it); changed = true; }
+            }
+        }
+        else {
+            auto& exif = img->exifData();
+            const std::string s = toExifString(t);
+            const std::pair<const char*, uint8_t> keys[] = { { "Exif.Photo.DateTimeOriginal", kMissingDateTimeOriginal },
+                { "Exif.Photo.DateTimeDigitized", kMissingDateTimeDigitized }, { "Exif.Image.DateTime", kMissingImageDateTime } };
+            for (const auto& k : keys) {
+                if (!(missingDates & k.second)) continue;
+                auto it = exif.findKey(Exiv2::ExifKey(k.first));
+                if (it != exif.end() && it->toString() == s) { exif.erase(it); changed = true; }
+            }
+        }
+        if (changed) img->writeMetadata();
+        return changed;
+    }
+    catch (const std::exception& e) {
+        STAT_ADD(kStatExceptions, 1);
+        if (verbose) log << "    date removal failed: " << e.what() << "\n";
+        return false;
+    }
+    catch (...) {
+        STAT_ADD(kStatExceptions, 1);
+        if (verbose) log << "    date removal failed: unknown error\n";
+        return false;
+    }
+}
+
+struct RollbackStats {
+    std::atomic<size_t> dates{ 0 }, sidecars{ 0 }, times{ 0 }, failed{ 0 };
+};
+
+static void rollbackFile(const ApplyJournalRecord& r, const fs::path& path, bool verbose, std::ostream& log,
+    RollbackStats& stats) {
+    const std::time_t target = (std::time_t)r.target;
+    if ((r.actions & kJournalExif) && r.missingDates && removeAddedDates(path, target, false, r.missingDates, verbose, log)) {
+        stats.dates++;
+    }
+    if (r.actions & kJournalXmp) {
+        const fs::path sidecar = xmpSidecarPath(path);
+        if (r.sidecarExisted) {
+            if (removeAddedDates(sidecar, target, true, 0, verbose, log)) stats.dates++;
+        }
+        else {
+            // created by the run: remove it unless it was changed since
+            std::ifstream in(sidecar, std::ios::binary);
+            const std::string packet = xmpSidecarPacket(target);
+            std::string have(packet.size() + 1, '\0');
+            in.read(&have[0], (std::streamsize)have.size());
+            in.close();
+            std::error_code ec;
+            if ((size_t)in.gcount() == packet.size() && have.compare(0, packet.size(), packet) == 0
+                && fs::remove(sidecar, ec)) {
+                stats.sidecars++;
+            }
+        }
+    }
+    if (r.actions & kJournalHasTimes) {
+        if (restoreNativeTimes(path, r.times)) stats.times++;
+        else {
+            stats.failed++;
+            if (verbose) log << "[FAIL] " << path << " (times not restored)\n";
+        }
+    }
+}
+
+// --rollback FILE: undo the run that wrote the journal, on --jobs threads
+static int runRollback(const Options& opt) {
+    std::ifstream in(opt.rollbackPath, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ApplyJournalHeader h{};
+    if (data.size() < sizeof(h)) {
+        std::cout << "Journal not found or empty: " << opt.rollbackPath << "\n";
+        return 1;
+    }
+    std::memcpy(&h, data.data(), sizeof(h));
+    if (std::memcmp(h.magic, kApplyJournalMagic, sizeof(h.magic)) != 0 || h.version != kApplyJournalVersion
+        || h.platform != kApplyJournalPlatform) {
+        std::cout << "Not a journal of this program and platform: " << opt.rollbackPath << "\n";
+        return 1;
+    }
+
+    std::vector<size_t> offsets; // of the intact records, a torn tail is dropped
+    for (size_t pos = sizeof(h); pos + sizeof(ApplyJournalRecord) <= data.size();) {
+        ApplyJournalRecord r;
+        std::memcpy(&r, data.data() + pos, sizeof(r));
+        const size_t next = pos + sizeof(r) + r.pathLen + (8 - r.pathLen % 8) % 8;
+        if (next > data.size() || journalChecksum(r, data.data() + pos + sizeof(r)) != r.checksum) break;
+        offsets.push_back(pos);
+        pos = next;
+    }
+    std::cout << "Rolling back " << offsets.size() << " files...\n";
+
+    Exiv2::XmpParser::initialize(); // not thread-safe, do it before the workers start
+    RollbackStats stats;
+    std::atomic<size_t> next{ 0 };
+    std::mutex outMutex;
+    IoThrottle throttle(opt);
+    auto work = [&] {
+        std::ostringstream log;
+        setThreadIoPriority(opt);
+        for (size_t k; (k = next.fetch_add(1)) < offsets.size();) {
+            ApplyJournalRecord r;
+            std::memcpy(&r, data.data() + offsets[k], sizeof(r));
+            const fs::path path = pathFromUtf8(std::string(data.data() + offsets[k] + sizeof(r), r.pathLen));
+            log.str(std::string());
+            throttle.run([&] { rollbackFile(r, path, opt.verbose, log, stats); });
+            if (log.tellp() > 0) {
+                std::lock_guard<std::mutex> lock(outMutex);
+                std::cout << log.str();
+            }
+        }
+        };
+    std::vector<std::thread> threads;
+    const size_t n = std::min<size_t>((size_t)std::max(1, opt.applyJobs), std::max<size_t>(1, offsets.size()));
+    for (size_t t = 1; t < n; ++t) threads.emplace_back([&] { work(); mergeThreadStats(); });
+    work();
+    for (auto& t : threads) t.join();
+
+    std::cout << "\nDone.\n";
+    std::cout << "Times restored: " << stats.times << "\n";
+    std::cout << "Dates removed: " << stats.dates << "\n";
+    std::cout << "Sidecars removed: " << stats.sidecars << "\n";
+    if (stats.failed) std::cout << "Failed: " << stats.failed << "\n";
+    return stats.failed ? 1 : 0;
+}
+
+// Folders a worker applies files in, kept open so files are reached by name relative to them (openat,
+// utimensat) instead of resolving the full path for every call. A few slots, as timeline order mixes folders.
+struct OpenDirs {
+#ifndef _WIN32
+    static constexpr size_t kSlots = 8;
+    uint32_t dirs[kSlots];
+    int fds[kSlots];
+    size_t next = 0;
+
+    OpenDirs() { std::fill(dirs, dirs + kSlots, UINT32_MAX); std::fill(fds, fds + kSlots, -1); }
+    OpenDirs(const OpenDirs&) = delete;
+    OpenDirs& operator=(const OpenDirs&) = delete;
+    ~OpenDirs() { for (int fd : fds) if (fd >= 0) ::close(fd); }
+
+    // descriptor of the folder, AT_FDCWD if it cannot be opened (names then are full paths)
+    int get(const PathArena& paths, uint32_t dir) {
+        for (size_t k = 0; k < kSlots; ++k) if (dirs[k] == dir) return fds[k] >= 0 ? fds[k] : AT_FDCWD;
+        const size_t k = next++ % kSlots;
+        if (fds[k] >= 0) ::close(fds[k]);
+        const std::string& text = *paths.dirs[dir];
+        dirs[k] = dir;
+        fds[k] = ::open(text.empty() ? "." : text.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        STAT_ADD(kStatSyscalls, 1);
+        return fds[k] >= 0 ? fds[k] : AT_FDCWD;
+    }
+#endif
+};
+
+// --apply-plan: mtime and size are still as planned, checked before anything is written
+static bool unchangedSincePlan(const ItemTable& items, size_t i, OpenDirs& dirs) {
+    std::string buf;
+    const fs::path path = itemPath(items, i, buf);
+#ifdef _WIN32
+    (void)dirs;
+    const FileStat fst = statFile(path);
+    return fst.mtime == items.mtime[i] && fst.size == items.fileSize[i];
+#else
+    const int dirFd = dirs.get(items.paths, items.paths.dirOf(items.pathId[i]));
+    const char* name = dirFd == AT_FDCWD ? buf.c_str() : items.fileName(i).data();
+    struct stat st {};
+    STAT_ADD(kStatSyscalls, 1);
+    if (fstatat(dirFd, name, &st, 0) != 0) return false;
+    return (int64_t)st.st_mtime == items.mtime[i] && (uint64_t)st.st_size == items.fileSize[i];
+#endif
+}
+
+// mtime and size are still as scanned (f: the open file, Windows: by path)
+static bool unchangedSinceScan(const ItemTable& items, size_t i, const RandomAccessFile& f, const fs::path& path) {
+#ifdef _WIN32
+    (void)f;
+    const FileStat fst = statFile(path);
+    return fst.mtime == items.mtime[i] && fst.size == items.fileSize[i];
+#else
+    (void)path;
+    struct stat st {};
+    STAT_ADD(kStatSyscalls, 1);
+    if (!f.isOpen() || fstat(f.fd, &st) != 0) return false;
+    return (int64_t)st.st_mtime == items.mtime[i] && (uint64_t)st.st_size == items.fileSize[i];
+#endif
+}
+
+// Write EXIF and file times of row i, report lines go to log. Returns the ItemFlag result bits.
+static uint8_t applyFile(const ItemTable& items, size_t i, const Options& opt, KeptMetadata& kept, OpenDirs& dirs,
+    std::ostream& log) {
+    uint8_t flags = 0;
+    std::string buf;
+    const fs::path path = itemPath(items, i, buf);
+    const std::time_t target = (std::time_t)items.target[i];
+    RandomAccessFile f; // open while EXIF is handled; file times are then set through it
+#ifndef _WIN32
+    const int dirFd = dirs.get(items.paths, items.paths.dirOf(items.pathId[i]));
+    const char* name = dirFd == AT_FDCWD ? buf.c_str() : items.fileName(i).data(); // names end with NUL in the arena
+#else
+    (void)dirs;
+#endif
+
+    // 1) write EXIF only if missing shot in metadata (safer: only write when metadata had no usable shot)
+    // Here "missingShot" might be true even if filename used as shot anchor earlier. We prefer to detect metadata-missing:
+    bool metadataHadShot = (items.shotSource[i] == ShotSource::ExifOrXmp);
+    bool shouldWriteExif = opt.writeExifIfMissing && !metadataHadShot; // only if metadata didn't already provide shot
+
+    if (shouldWriteExif && opt.xmpSidecar) {
+        uint64_t bytes = 0;
+        if (writeXmpSidecarIfMissing(path, target, opt.verbose, log, bytes)) {
+            flags |= kXmpWritten;
+            log << "       XMP : sidecar written (" << bytes << " bytes)\n";
+        }
+        else {
+            log << "       XMP : sidecar not written (already dated or write failed)\n";
+        }
+    }
+    else if (shouldWriteExif) {
+        // what the read stage learned holds only while the file is as scanned
+        std::unique_ptr<Exiv2::Image> parsed = kept.take(items.pathId[i]);
+        bool nothingToWrite = (items.flags[i] & kNoExifToWrite) != 0;
+#ifdef _WIN32
+        f.open(path);
+#else
+        f.openAt(dirFd, name);
+#endif
+        if (nothingToWrite || parsed) {
+            if (!unchangedSinceScan(items, i, f, path)) {
+                if (opt.verbose) log << "    changed since the scan, reading metadata again\n";
+                nothingToWrite = false;
+                parsed.reset();
+            }
+        }
+        ExifWriteStats ws;
+        if (!nothingToWrite && writeExifShotIfMissing(path, f, target, opt, std::move(parsed), log, ws)) {
+            flags |= kExifWritten;
+            log << "       EXIF: written (missing keys, " << (ws.inPlace ? "in place" : "file rewritten")
+                << (ws.reflink ? " on a reflink copy" : "") << ", " << ws.bytes << " bytes)\n";
+        }
+        else {
+            log << "       EXIF: not written (maybe unsupported format or already present)\n";
+        }
+    }
+
+    // 2) sync file system times (unless they already are the target and the file was not written)
+#ifdef _WIN32
+    const bool timesMatch = opt.syncFileTimes && !(flags & kExifWritten) && fileTimesMatch(items, i, target, path);
+#else
+    const bool timesMatch = opt.syncFileTimes && !(flags & kExifWritten)
+        && fileTimesMatch(items, i, target, f.fd, dirFd, name);
+#endif
+    if (timesMatch) {
+        flags |= kFsTimesMatched;
+        log << "       FS  : times already match target\n";
+    }
+    else if (opt.syncFileTimes) {
+#ifdef _WIN32
+        f.close();
+        if (setFileTimesWindows(path, target, opt.verbose, log)) {
+#else
+        if (setFileTimesPosix(f.fd, dirFd, name, target, opt.verbose, log)) {
+#endif
+            flags |= kFsTimesSynced;
+            log << "       FS  : times updated\n";
+        }
+        else {
+            log << "       FS  : update failed\n";
+        }
+    }
+    if ((flags & (kFsTimesSynced | kFsTimesMatched)) || (!opt.syncFileTimes && (flags & (kExifWritten | kXmpWritten)))) {
+        flags |= kTargetApplied;
+    }
+    return flags;
+}
+
+// Runs applyFile() for rows on worker threads: rows are grouped by the device of their folder and every
+// device gets its own limit of parallel writes (deviceJobsFor). Each device works through its rows in
+// timeline order, and wait() hands the reports back in timeline order as well. Workers only read items.
+// With a journal, one more thread records the rows in order and a row is applied only once its record
+// is committed. checkUnchanged (--apply-plan) skips files whose mtime or size differ from items.
+struct ParallelApply {
+    static constexpr size_t kAhead = 4096;  // reports finished ahead of the printed one, at most
+    static constexpr size_t kTraceBatch = 64; // files per "apply batch" trace span of a worker
+
+    struct Device {
+        uint64_t id = 0;
+        std::vector<size_t> jobs;           // positions in rows, ascending
+        std::atomic<size_t> next{ 0 };
+    };
+
+    const ItemTable& items;
+    const Options& opt;
+    KeptMetadata& kept;
+    ApplyJournal* journal;
+    IoThrottle& throttle;
+    LatencyStats* latency;                  // --stats: apply times, nullptr when not collected
+    const std::vector<uint32_t>& rows;
+    std::vector<std::string> reports;
+    std::vector<uint8_t> results;           // applyFile() flags
+    std::vector<uint8_t> done;
+    size_t printed = 0;
+    size_t journaled = 0;                   // rows[0, journaled) are on disk in the journal
+    bool journalFailed = false;
+    const bool checkUnchanged;
+    std::atomic<size_t> changedSincePlan{ 0 };
+    std::mutex mutex;
+    std::condition_variable doneCv, aheadCv;
+    std::vector<std::unique_ptr<Device>> devices;
+    std::vector<std::thread> threads;
+
+    ParallelApply(const ItemTable& items_, const std::vector<uint32_t>& rows_, const Options& opt_, KeptMetadata& kept_,
+        ApplyJournal* journal_, IoThrottle& throttle_, LatencyStats* latency_, bool checkUnchanged_ = false)
+        : items(items_), opt(opt_), kept(kept_), journal(journal_), throttle(throttle_), latency(latency_), rows(rows_), reports(rows_.size()), results(rows_.size(), 0), done(rows_.size(), 0),
+        checkUnchanged(checkUnchanged_) {
+        if (!journal) journaled = rows.size();
+        std::unordered_map<uint32_t, size_t> deviceOfDir;  // folder id -> devices[]
+        std::unordered_map<uint64_t, size_t> deviceIndex;
+        std::vector<int> limits;
+        for (size_t k = 0; k < rows.size(); ++k) {
+            const uint32_t dir = items.paths.dirOf(items.pathId[rows[k]]);
+            auto d = deviceOfDir.find(dir);
+            if (d == deviceOfDir.end()) {
+                const std::string& dirText = *items.paths.dirs[dir];
+                const uint64_t dev = deviceIdOf(pathFromUtf8(dirText.empty() ? std::string(".") : dirText));
+                auto di = deviceIndex.find(dev);
+                if (di == deviceIndex.end()) {
+                    di = deviceIndex.emplace(dev, devices.size()).first;
+                    devices.push_back(std::make_unique<Device>());
+                    devices.back()->id = dev;
+                    limits.push_back(deviceJobsFor(dev, opt));
+                }
+                d = deviceOfDir.emplace(dir, di->second).first;
+            }
+            devices[d->second]->jobs.push_back(k);
+        }
+        if (journal && !rows.empty()) {
+            threads.emplace_back([this] { traceThreadName("journal"); writeJournal(); mergeThreadStats(); });
+        }
+        for (size_t d = 0; d < devices.size(); ++d) {
+            const size_t n = std::min((size_t)limits[d], devices[d]->jobs.size());
+            for (size_t t = 0; t < n; ++t) threads.emplace_back([this, d] { work(*devices[d]); mergeThreadStats(); });
+        }
+    }
+
+    ParallelApply(const ParallelApply&) = delete;
+    ParallelApply& operator=(const ParallelApply&) = delete;
+
+    ~ParallelApply() { finish(); }
+
+    // waits for the workers to end
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            printed = rows.size(); // nobody prints any more, let the workers finish
+        }
+        aheadCv.notify_all();
+        for (auto& t : threads) t.join();
+        threads.clear();
+    }
+
+    void writeJournal() {
+        std::string buf;
+        for (size_t k = 0; k < rows.size(); ++k) {
+            const size_t i = rows[k];
+            journal->add(itemPath(items, i, buf), items.target[i], journalActions(items, i, opt), items.missingDates[i]);
+            if (journal->pendingCount < journal->syncEvery && k + 1 < rows.size()) continue;
+            TraceSpan span("journal commit", "records", journal->pendingCount);
+            const bool ok = journal->commit();
+            span.end();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ok) journaled = k + 1;
+            else journalFailed = true;
+            aheadCv.notify_all();
+            if (!ok) return;
+        }
+    }
+
+    void work(Device& dev) {
+        std::ostringstream log;
+        OpenDirs dirs;
+        setThreadIoPriority(opt);
+        traceThreadName("apply " + deviceLabel(dev.id));
+        TraceSpan batch;
+        for (size_t taken = 0;; ++taken) {
+            const size_t j = dev.next.fetch_add(1);
+            if (j >= dev.jobs.size()) return;
+            const size_t k = dev.jobs[j];
+            if (taken % kTraceBatch == 0) batch.begin("apply batch", "first row", k);
+            bool recorded;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                traceWait(aheadCv, lock, "wait for report or journal",
+                    [&] { return k < printed + kAhead && (k < journaled || journalFailed); });
+                recorded = k < journaled;
+            }
+            log.str(std::string());
+            uint8_t flags = 0;
+            if (!recorded) {
+                log << "       JOURNAL: write failed, file not changed\n";
+            }
+            else if (checkUnchanged && !unchangedSincePlan(items, rows[k], dirs)) {
+                changedSincePlan++;
+                log << "       SKIP: changed or gone since the plan\n";
+            }
+            else {
+                throttle.run([&] {
+                    const auto start = std::chrono::steady_clock::now();
+                    flags = applyFile(items, rows[k], opt, kept, dirs, log);
+                    if (latency) {
+                        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                        latency->record(kLatencyApply, items, rows[k], dev.id, seconds);
+                        latency->offer(items, rows[k], items.readSeconds.empty() ? 0 : items.readSeconds[rows[k]], seconds);
+                    }
+                    });
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            reports[k] = log.str();
+            results[k] = flags;
+            done[k] = 1;
+            doneCv.notify_all();
+        }
+    }
+
+    // report and result flags of rows[k] once it is applied; call for k = 0, 1, 2, ...
+    std::string wait(size_t k, uint8_t& flags) {
+        std::unique_lock<std::mutex> lock(mutex);
+        traceWait(doneCv, lock, "wait for apply", [&] { return done[k] != 0; });
+        printed = k + 1;
+        aheadCv.notify_all();
+        flags = results[k];
+        return std::move(reports[k]);
+    }
+};
+
+// ---------- report output ----------
+// Per-file report lines are formatted into a large buffer; a writer thread writes full buffers out while the
+// next one fills, so a slow terminal or pipe does not hold up the run. Formats: human (the classic text),
+// JSON Lines and CSV (one record per file, for tools). Batch runs print the summary only unless --report is
+// given; interactive runs print the human report.
+enum class ReportAction : uint8_t {
+    NoTarget,       // no target inferred, nothing to do
+    Unchanged,      // target already applied by an earlier run
+    DryRun,
+    Applied         // applied; flags and log tell what happened
+};
+
+static const char* reportActionName(ReportAction a) {
+    switch (a) {
+    case ReportAction::NoTarget: return "no-target";
+    case ReportAction::Unchanged: return "unchanged";
+    case ReportAction::DryRun: return "dry-run";
+    case ReportAction::Applied: return "applied";
+    }
+    return "";
+}
+
+static void appendJsonString(std::string& out, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if ((unsigned char)c < 0x20) { out += "\\u00"; out += hex[(c >> 4) & 0xF]; out += hex[c & 0xF]; }
+        else out += c;
+    }
+    out += '"';
+}
+
+static void appendCsvField(std::string& out, std::string_view s) {
+    if (s.find_first_of(",\"\r\n") == std::string_view::npos) { out.append(s.data(), s.size()); return; }
+    out += '"';
+    for (char c : s) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+// the way fs::path is printed to a stream (std::quoted)
+static void appendQuoted(std::string& out, std::string_view s) {
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    out += '"';
+}
+
+struct ReportWriter {
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    ReportFormat format;
+    bool verbose;
+    std::FILE* out = nullptr;
+    bool ownsFile = false;
+    std::string buf;        // being filled
+    std::string pending;    // being written by the writer thread
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread writer;
+    std::string pathBuf;
+
+    // file empty: standard output
+    ReportWriter(ReportFormat format_, const fs::path& file, bool verbose_) : format(format_), verbose(verbose_) {
+        if (format == ReportFormat::None) return;
+        if (!file.empty()) {
+#ifdef _WIN32
+            out = _wfopen(file.wstring().c_str(), L"wb");
+#else
+            out = std::fopen(file.c_str(), "wb");
+#endif
+            ownsFile = out != nullptr;
+        }
+        if (!out) {
+            if (!file.empty()) std::cout << "Cannot write the report to " << file << ", using standard output\n";
+            std::cout.flush();
+            out = stdout;
+        }
+        buf.reserve(kBufferSize);
+        pending.reserve(kBufferSize);
+        writer = std::thread([this] { traceThreadName("report writer"); writeLoop(); mergeThreadStats(); });
+        if (format == ReportFormat::Human) buf += "----\n";
+        else if (format == ReportFormat::Csv) buf += "path,shot,target,target_local,reason,mtime,action,exif_written,xmp_written,fs_times\n";
+    }
+
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+    ~ReportWriter() { close(); }
+
+    bool active() const { return format != ReportFormat::None; }
+
+    void writeLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [&] { return stop || !pending.empty(); });
+            if (pending.empty()) return;
+            lock.unlock();
+            {
+                TraceSpan span("report write", "bytes", pending.size());
+                std::fwrite(pending.data(), 1, pending.size(), out);
+            }
+            lock.lock();
+            pending.clear();
+            cv.notify_all();
+        }
+    }
+
+    // hand the filled buffer to the writer thread (waits while it still writes the previous one)
+    void handOver() {
+        if (buf.empty()) return;
+        std::unique_lock<std::mutex> lock(mutex);
+        traceWait(cv, lock, "wait for report writer", [&] { return pending.empty(); });
+        pending.swap(buf);
+        cv.notify_all();
+    }
+
+    // writes everything out; call before printing anything else to the same output
+    void close() {
+        if (!writer.joinable()) return;
+        handOver();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        writer.join();
+        std::fflush(out);
+        if (ownsFile) std::fclose(out);
+        out = nullptr;
+    }
+
+    // one file; applied: applyFile() flags, log: its report lines (human format only)
+    void file(const ItemTable& items, size_t i, ReportAction action, uint8_t applied = 0, std::string_view log = {}) {
+        if (!active()) return;
+        const std::string_view path = items.pathUtf8(i, pathBuf);
+        if (format == ReportFormat::Human) human(items, i, path, action, log);
+        else structured(items, i, path, action, applied);
+        if (buf.size() >= kBufferSize) handOver();
+    }
+
+    void human(const ItemTable& items, size_t i, std::string_view path, ReportAction action, std::string_view log) {
+        if (action == ReportAction::NoTarget) {
+            if (!verbose) return;
+            buf += "[SKIP] ";
+            appendQuoted(buf, path);
+            buf += " (no target time inferred)\n";
+            return;
+        }
+        buf += items.hasShot(i) ? "[OK]   " : "[FILL] ";
+        appendQuoted(buf, path);
+        buf += "\n       target: ";
+        buf += formatLocalTime((std::time_t)items.target[i]);
+        buf += "   (";
+        buf += reasonText(items.reason[i], items.flags[i]);
+        buf += ")\n       mtime : ";
+        buf += formatLocalTime((std::time_t)items.mtime[i]);
+        buf += '\n';
+#ifdef _WIN32
+        if (items.ctime[i] != kNoTime && items.wtime[i] != kNoTime) {
+            buf += "       ctime : " + formatLocalTime((std::time_t)items.ctime[i]) + "\n";
+            buf += "       wtime : " + formatLocalTime((std::time_t)items.wtime[i]) + "\n";
+        }
+#endif
+        if (action == ReportAction::Unchanged) buf += "       unchanged: target already applied\n";
+        else if (action == ReportAction::DryRun) buf += "       dry-run: no changes\n";
+        else buf.append(log.data(), log.size());
+        buf += "----\n";
+    }
+
+    void structured(const ItemTable& items, size_t i, std::string_view path, ReportAction action, uint8_t applied) {
+        const bool json = format == ReportFormat::Jsonl;
+        const bool hasTarget = items.hasTarget(i);
+        const std::string targetLocal = hasTarget ? formatLocalTime((std::time_t)items.target[i]) : std::string();
+        const std::string reason = hasTarget ? reasonText(items.reason[i], items.flags[i]) : std::string();
+        const char* fsTimes = action != ReportAction::Applied ? "" : (applied & kFsTimesSynced) ? "updated"
+            : (applied & kFsTimesMatched) ? "matched" : "not-updated";
+        const char* exif = (applied & kExifWritten) ? "true" : "false";
+        const char* xmp = (applied & kXmpWritten) ? "true" : "false";
+        const char* shot = items.hasShot(i) ? "true" : "false";
+        if (json) {
+            buf += "{\"path\":";
+            appendJsonString(buf, path);
+            buf += ",\"shot\":";
+            buf += shot;
+            buf += ",\"target\":";
+            buf += hasTarget ? std::to_string(items.target[i]) : std::string("null");
+            buf += ",\"target_local\":";
+            if (hasTarget) appendJsonString(buf, targetLocal); else buf += "null";
+            buf += ",\"reason\":";
+            appendJsonString(buf, reason);
+            buf += ",\"mtime\":";
+            buf += std::to_string(items.mtime[i]);
+            buf += ",\"action\":\"";
+            buf += reportActionName(action);
+            buf += '"';
+            if (action == ReportAction::Applied) {
+                buf += ",\"exif_written\":";
+                buf += exif;
+                buf += ",\"xmp_written\":";
+                buf += xmp;
+                buf += ",\"fs_times\":\"";
+                buf += fsTimes;
+                buf += '"';
+            }
+            buf += "}\n";
+        }
+        else {
+            appendCsvField(buf, path);
+            buf += ',';
+            buf += shot;
+            buf += ',';
+            if (hasTarget) buf += std::to_string(items.target[i]);
+            buf += ',';
+            buf += targetLocal;
+            buf += ',';
+            appendCsvField(buf, reason);
+            buf += ',';
+            buf += std::to_string(items.mtime[i]);
+            buf += ',';
+            buf += reportActionName(action);
+            buf += ',';
+            if (action == ReportAction::Applied) buf += exif;
+            buf += ',';
+            if (action == ReportAction::Applied) buf += xmp;
+            buf += ',';
+            buf += fsTimes;
+            buf += '\n';
+        }
+    }
+};
+
+// --stats FILE: this run's statistics as JSON; start: when the run began, latency: if collected
+static void saveRunStats(const Options& opt, size_t files, std::chrono::steady_clock::time_point start,
+    LatencyStats* latency = nullptr) {
+    if (opt.statsPath.empty()) return;
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6);
+    out << "{\n  \"files\": " << files << ",\n  \"wall_seconds\": " << wall;
+#ifndef PHOTO_TIMEFIX_NO_STATS
+    mergeThreadStats();
+    RunStats& s = runStats();
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        const HardwareCounters& hw = hardwareCounters();
+        std::string hwState;
+        appendJsonString(hwState, hw.unavailable.empty() ? "on" : hw.unavailable);
+        out << ",\n  \"hardware_counters\": " << hwState << ",\n  \"stages\": {\n";
+        for (size_t k = 0; k < kStageCount; ++k) {
+            out << "    \"" << kStatStageNames[k] << "\": { \"seconds\": " << s.seconds[k] << ", \"calls\": " << s.calls[k]
+                << ", \"storage_read_bytes\": " << s.storageRead[k] << ", \"storage_written_bytes\": " << s.storageWritten[k];
+            if (hw.unavailable.empty()) {
+                for (int c = 0; c < kHwCounterCount; ++c) {
+                    if (hw.fds[c] >= 0) out << ", \"" << kHwCounterNames[c] << "\": " << s.hardware[k][c];
+                }
+                const uint64_t cycles = s.hardware[k][kHwCycles], instructions = s.hardware[k][kHwInstructions];
+                if (hw.fds[kHwInstructions] >= 0 && cycles) out << ", \"ipc\": " << (double)instructions / (double)cycles;
+            }
+            out << " }" << (k + 1 < kStageCount ? ",\n" : "\n");
+        }
+        out << "  },\n  \"counters\": {\n";
+        for (size_t k = 0; k < kStatCounterCount; ++k) {
+            out << "    \"" << kStatCounterNames[k] << "\": " << s.counters[k] << (k + 1 < kStatCounterCount ? ",\n" : "\n");
+        }
+        out << "  }";
+    }
+#else
+    out << ",\n  \"stats\": \"compiled out (PHOTO_TIMEFIX_NO_STATS)\"";
+#endif
+    if (latency) {
+        std::lock_guard<std::mutex> lock(latency->mutex);
+        const auto quoted = [](std::string_view text) {
+            std::string q;
+            appendJsonString(q, text);
+            return q;
+            };
+        const auto histogram = [&](const std::string& key, const LatencyHistogram& h, bool last) {
+            out << "        " << quoted(key) << ": { \"count\": " << h.count << ", \"mean\": " << h.sumUs / 1000 / (double)h.count
+                << ", \"p50\": " << h.percentileUs(0.5) / 1000 << ", \"p90\": " << h.percentileUs(0.9) / 1000
+                << ", \"p99\": " << h.percentileUs(0.99) / 1000 << ", \"max\": " << (double)h.maxUs / 1000
+                << " }" << (last ? "\n" : ",\n");
+            };
+        out << ",\n  \"latency_ms\": {\n";
+        for (int stage = 0; stage < kLatencyStageCount; ++stage) {
+            out << "    \"" << (stage == kLatencyRead ? "read" : "apply") << "\": {\n      \"by_format\": {\n";
+            std::vector<std::string> formats;
+            for (const auto& f : latency->byFormat[stage]) formats.push_back(f.first);
+            std::sort(formats.begin(), formats.end());
+            for (size_t k = 0; k < formats.size(); ++k) {
+                histogram(formats[k], latency->byFormat[stage][formats[k]], k + 1 == formats.size());
+            }
+            out << "      },\n      \"by_device\": {\n";
+            std::vector<uint64_t> devices;
+            for (const auto& d : latency->byDevice[stage]) devices.push_back(d.first);
+            std::sort(devices.begin(), devices.end());
+            for (size_t k = 0; k < devices.size(); ++k) {
+                histogram(deviceLabel(devices[k]), latency->byDevice[stage][devices[k]], k + 1 == devices.size());
+            }
+            out << "      }\n    }" << (stage + 1 < kLatencyStageCount ? ",\n" : "\n");
+        }
+        out << "  },\n  \"slowest\": [\n";
+        std::vector<SlowFile> slowest = latency->slowest;
+        std::sort(slowest.begin(), slowest.end(), [](const SlowFile& a, const SlowFile& b) { return a.total() > b.total(); });
+        for (size_t k = 0; k < slowest.size(); ++k) {
+            const SlowFile& f = slowest[k];
+            out << "    { \"path\": " << quoted(f.path) << ", \"format\": " << quoted(f.format) << ", \"total_ms\": "
+                << f.total() * 1000 << ", \"read_ms\": " << f.read * 1000 << ", \"apply_ms\": " << f.apply * 1000
+                << " }" << (k + 1 < slowest.size() ? ",\n" : "\n");
+        }
+        out << "  ]";
+    }
+    out << "\n}\n";
+    std::ofstream f(opt.statsPath, std::ios::binary | std::ios::trunc);
+    if (f << out.str() && f.flush()) std::cout << "Stats written: " << opt.statsPath << "\n";
+    else std::cout << "Stats write failed: " << opt.statsPath << "\n";
+}
+
+// --trace FILE: the recorded spans as Chrome trace JSON; call when the traced threads have ended
+static void saveTrace(const Options& opt) {
+    if (opt.tracePath.empty()) return;
+    Tracer& t = tracer();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    std::string text;
+    const auto quoted = [&](std::string_view s) -> const std::string& {
+        text.clear();
+        appendJsonString(text, s);
+        return text;
+        };
+    uint64_t events = 0, dropped = 0;
+    const char* sep = "";
+    for (const auto& th : t.threads) {
+        dropped += th->recorded - th->ring.size();
+        if (!th->name.empty()) {
+            out << sep << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << th->id
+                << ", \"args\": {\"name\": " << quoted(th->name) << "}}";
+            sep = ",\n";
+        }
+        for (const TraceEvent& e : th->ring) {
+            out << sep << "{\"name\": " << quoted(e.name) << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << th->id
+                << ", \"ts\": " << (double)e.start / 1000 << ", \"dur\": " << (double)e.duration / 1000;
+            if (e.argName || !e.detail.empty()) {
+                out << ", \"args\": {";
+                if (e.argName) out << quoted(e.argName) << ": " << e.arg;
+                if (!e.detail.empty()) out << (e.argName ? ", " : "") << "\"detail\": " << quoted(e.detail);
+                out << "}";
+            }
+            out << "}";
+            sep = ",\n";
+            events++;
+        }
+    }
+    out << "\n], \"otherData\": {\"dropped_events\": " << dropped << "}}\n";
+    std::ofstream f(opt.tracePath, std::ios::binary | std::ios::trunc);
+    if (f << out.str() && f.flush()) {
+        std::cout << "Trace written: " << opt.tracePath << " (" << events << " spans";
+        if (dropped) std::cout << ", " << dropped << " older ones overwritten";
+        std::cout << ")\n";
+    }
+    else {
+        std::cout << "Trace write failed: " << opt.tracePath << "\n";
+    }
+}
+
+// ---------- plan file ----------
+// A dry-run with --plan FILE stores what the apply stage needs, so --apply-plan FILE applies it later without
+// scanning, reading metadata or planning again. Files that changed since planning (mtime or size) are skipped.
+// Layout: header | root (UTF-8, names are relative to it) | one record per file to apply, in timeline order:
+//   varint shared prefix with the previous name | varint suffix length | suffix
+//   | zigzag varint target - previous target | zigzag varint mtime - target | varint size
+//   | shotSource | reason | flags (kPlanHasWindowsTimes: zigzag varint ctime - mtime, wtime - mtime follow)
+// Records are read straight from the mapping, in batches of kPlanBatch files.
+static constexpr char kPlanMagic[8] = { 'P', 'T', 'F', 'P', 'L', 'A', 'N', '1' };
+static constexpr uint32_t kPlanVersion = 1;
+static constexpr size_t kPlanBatch = 65536;
+
+struct PlanHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t rootLen;
+    uint64_t count;
+    // apply options the plan was made for
+    uint8_t writeExifIfMissing;
+    uint8_t syncFileTimes;
+    uint8_t xmpSidecar;
+    uint8_t reserved;
+    uint32_t reserved1;
+};
+
+static_assert(sizeof(PlanHeader) == 32, "plan header layout");
+
+enum PlanRecordFlag : uint8_t {
+    kPlanNoExifToWrite = 1,     // kNoExifToWrite of the scan
+    kPlanHasWindowsTimes = 2
+};
+static constexpr int kPlanMissingDatesShift = 4; // the high 4 bits: ItemTable::missingDates (0: unknown)
+
+static void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) { out.push_back((char)(v | 0x80)); v >>= 7; }
+    out.push_back((char)v);
+}
+
+static void putZigzag(std::string& out, int64_t v) { putVarint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+
+// false when the data ends first
+static bool getVarint(const unsigned char*& p, const unsigned char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const unsigned char b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool getZigzag(const unsigned char*& p, const unsigned char* end, int64_t& v) {
+    uint64_t u = 0;
+    if (!getVarint(p, end, u)) return false;
+    v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return true;
+}
+
+// rows: the rows to apply, in timeline order; names: their paths relative to rootUtf8 (absolute)
+static bool writePlan(const fs::path& file, const std::string& rootUtf8, const IndexNames& names,
+    const std::vector<uint32_t>& rows, const Options& opt) {
+    const ItemTable& items = names.items;
+    PlanHeader h{};
+    std::memcpy(h.magic, kPlanMagic, sizeof(h.magic));
+    h.version = kPlanVersion;
+    h.rootLen = (uint32_t)rootUtf8.size();
+    h.count = rows.size();
+    h.writeExifIfMissing = opt.writeExifIfMissing;
+    h.syncFileTimes = opt.syncFileTimes;
+    h.xmpSidecar = opt.xmpSidecar;
+
+    fs::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write((const char*)&h, sizeof(h));
+        out.write(rootUtf8.data(), (std::streamsize)rootUtf8.size());
+
+        std::string buf, prevName;
+        int64_t prevTarget = 0;
+        for (uint32_t i : rows) {
+            const std::string_view name = names(i);
+            if (name.empty()) return false;
+            size_t shared = 0;
+            while (shared < name.size() && shared < prevName.size() && name[shared] == prevName[shared]) shared++;
+            putVarint(buf, shared);
+            putVarint(buf, name.size() - shared);
+            buf.append(name.data() + shared, name.size() - shared);
+            prevName.assign(name.data(), name.size());
+
+            putZigzag(buf, items.target[i] - prevTarget);
+            prevTarget = items.target[i];
+            putZigzag(buf, items.mtime[i] - items.target[i]);
+            putVarint(buf, items.fileSize[i]);
+            buf.push_back((char)items.shotSource[i]);
+            buf.push_back((char)items.reason[i]);
+            uint8_t flags = (items.flags[i] & kNoExifToWrite) ? kPlanNoExifToWrite : 0;
+            flags |= (uint8_t)(items.missingDates[i] << kPlanMissingDatesShift);
+#ifdef _WIN32
+            if (items.ctime[i] != kNoTime && items.wtime[i] != kNoTime) flags |= kPlanHasWindowsTimes;
+#endif
+            buf.push_back((char)flags);
+#ifdef _WIN32
+            if (flags & kPlanHasWindowsTimes) {
+                putZigzag(buf, items.ctime[i] - items.mtime[i]);
+                putZigzag(buf, items.wtime[i] - items.mtime[i]);
+            }
+#endif
+            if (buf.size() >= (1u << 20)) {
+                out.write(buf.data(), (std::streamsize)buf.size());
+                buf.clear();
+            }
+        }
+        out.write(buf.data(), (std::streamsize)buf.size());
+        if (!out) return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if (ec) { fs::remove(tmp, ec); return false; }
+    return true;
+}
+
+struct PlanReader {
+    MappedFile file;
+    const PlanHeader* header = nullptr;
+    std::string root;
+    const unsigned char* pos = nullptr;
+    const unsigned char* end = nullptr;
+    uint64_t left = 0;
+    std::string name;
+    int64_t target = 0;
+
+    bool open(const fs::path& p) {
+        if (!file.open(p) || file.size < sizeof(PlanHeader)) return false;
+        header = (const PlanHeader*)file.data;
+        if (std::memcmp(header->magic, kPlanMagic, sizeof(header->magic)) != 0) return false;
+        if (header->version != kPlanVersion || sizeof(PlanHeader) + header->rootLen > file.size) return false;
+        root.assign((const char*)file.data + sizeof(PlanHeader), header->rootLen);
+        pos = file.data + sizeof(PlanHeader) + header->rootLen;
+        end = file.data + file.size;
+        left = header->count;
+        return true;
+    }
+
+    // up to kPlanBatch more records as rows of items (cleared first); false if the plan is damaged, items then
+    // holds the records before the damage
+    bool next(ItemTable& items) {
+        items = ItemTable();
+        std::string path;
+        while (left > 0 && items.size() < kPlanBatch) {
+            uint64_t shared = 0, suffix = 0, size = 0;
+            int64_t delta = 0, mtimeDelta = 0;
+            if (!getVarint(pos, end, shared) || !getVarint(pos, end, suffix) || shared > name.size()
+                || suffix > (uint64_t)(end - pos)) return false;
+            name.resize((size_t)shared);
+            name.append((const char*)pos, (size_t)suffix);
+            pos += suffix;
+            if (!getZigzag(pos, end, delta) || !getZigzag(pos, end, mtimeDelta) || !getVarint(pos, end, size)
+                || end - pos < 3) return false;
+            target += delta;
+            const uint8_t shotSource = pos[0], reason = pos[1], flags = pos[2];
+            pos += 3;
+            int64_t ctimeDelta = 0, wtimeDelta = 0;
+            if ((flags & kPlanHasWindowsTimes) && (!getZigzag(pos, end, ctimeDelta) || !getZigzag(pos, end, wtimeDelta))) {
+                return false;
+            }
+
+            path = root;
+            if (!path.empty() && path.back() != '/' && path.back() != '\\') path += '/';
+            path += name;
+            if (!items.add(path)) return false;
+            const size_t i = items.size() - 1;
+            items.target[i] = target;
+            items.mtime[i] = target + mtimeDelta;
+            items.fileSize[i] = size;
+            items.shotSource[i] = (ShotSource)shotSource;
+            if (items.shotSource[i] != ShotSource::None) items.shot[i] = target; // only "has a shot" is used
+            items.reason[i] = (TargetReason)reason;
+            if (flags & kPlanNoExifToWrite) items.flags[i] |= kNoExifToWrite;
+            items.missingDates[i] = (uint8_t)(flags >> kPlanMissingDatesShift);
+#ifdef _WIN32
+            if (flags & kPlanHasWindowsTimes) {
+                items.ctime[i] = items.mtime[i] + ctimeDelta;
+                items.wtime[i] = items.mtime[i] + wtimeDelta;
+            }
+#endif
+            left--;
+        }
+        return true;
+    }
+};
+
+// --apply-plan: apply a plan written by a dry-run with --plan, without scanning
+static int runPlanApply(Options opt) {
+    const auto start = std::chrono::steady_clock::now();
+    PlanReader plan;
+    if (!plan.open(opt.applyPlanPath)) {
+        std::cout << "Cannot read the plan: " << opt.applyPlanPath << "\n";
+        return 1;
+    }
+    opt.dryRun = false;
+    opt.writeExifIfMissing = plan.header->writeExifIfMissing != 0;
+    opt.syncFileTimes = plan.header->syncFileTimes != 0;
+    opt.xmpSidecar = plan.header->xmpSidecar != 0;
+    std::cout << "Applying plan " << opt.applyPlanPath << ": " << plan.header->count << " files below " << plan.root << "\n";
+
+    Exiv2::XmpParser::initialize(); // not thread-safe, do it before the workers start
+    ApplyJournal journal;
+    const bool journaling = !opt.journalPath.empty() && plan.header->count > 0;
+    if (journaling && !journal.create(opt.journalPath, opt.journalSyncEvery)) {
+        std::cout << "Cannot create the journal: " << opt.journalPath << "\n";
+        return 1;
+    }
+    KeptMetadata kept;
+    IoThrottle throttle(opt);
+    std::unique_ptr<LatencyStats> latency;
+    if (!opt.statsPath.empty()) latency = std::make_unique<LatencyStats>(opt.slowestFiles);
+    size_t changedExif = 0, changedXmp = 0, changedFs = 0, matchedFs = 0, changedSincePlan = 0, folders = 0;
+    ItemTable items;
+    std::vector<uint32_t> rows;
+    ReportWriter report(opt.reportFormat, opt.reportPath, opt.verbose);
+    Progress progress;
+    progress.enter(Stage::Apply, plan.header->count);
+    ProgressReporter progressReporter(progress, opt.progress, opt.progressJsonEvery);
+    StageTimer applyTimer(kStageApply);
+    bool damaged = false;
+    while (plan.left > 0 && !damaged) {
+        damaged = !plan.next(items); // the records read before the damage are still applied
+        rows.resize(items.size());
+        for (uint32_t i = 0; i < (uint32_t)rows.size(); ++i) rows[i] = i;
+        uint8_t batchFlags = 0;
+        {
+            ParallelApply apply(items, rows, opt, kept, journaling ? &journal : nullptr, throttle, latency.get(), true);
+            for (size_t i = 0; i < items.size(); ++i) {
+                uint8_t applied = 0;
+                const std::string log = apply.wait(i, applied);
+                report.file(items, i, ReportAction::Applied, applied, log);
+                progress.add(Stage::Apply);
+                batchFlags |= applied;
+                if (applied & kExifWritten) changedExif++;
+                if (applied & kXmpWritten) changedXmp++;
+                if (applied & kFsTimesSynced) changedFs++;
+                if (applied & kFsTimesMatched) matchedFs++;
+                items.flags[i] |= applied;
+            }
+            changedSincePlan += apply.changedSincePlan;
+        }
+        if (batchFlags & kXmpWritten) folders += syncXmpSidecars(items);
+    }
+    report.close();
+    progressReporter.finish();
+    applyTimer.stop();
+
+    std::cout << "\nDone.\n";
+    if (opt.xmpSidecar) std::cout << "XMP sidecars written (missing-only): " << changedXmp << " (synced " << folders << " folders)\n";
+    else std::cout << "EXIF updated (missing-only): " << changedExif << "\n";
+    std::cout << "Filesystem times updated: " << changedFs << "\n";
+    if (matchedFs) std::cout << "Filesystem times already matching: " << matchedFs << "\n";
+    if (changedSincePlan) std::cout << "Changed since the plan (skipped): " << changedSincePlan << "\n";
+    if (journaling) std::cout << "Journal: " << opt.journalPath << " (undo with --rollback)\n";
+    saveRunStats(opt, plan.header->count - plan.left, start, latency.get());
+    saveTrace(opt);
+    if (damaged) {
+        std::cout << "The plan is damaged, stopped after " << (plan.header->count - plan.left) << " files.\n";
+        return 1;
+    }
+    return 0;
+}
+
+// ---------- interactive input helpers ----------
+static bool askYesNo(const std::string& q, bool def) {
+    std::cout << q << (def ? " [Y/n]: " : " [y/N]: ");
+    std::string s;
+    std::getline(std::cin, s);
+    s = trim(s);
+    if (s.empty()) return def;
+    char c = (char)std::tolower((unsigned char)s[0]);
+    return c == 'y' || c == '1' || c == 't';
+}
+
+static long long askInt64(const std::string& q, long long def) {
+    std::cout << q << " (default " << def << "): ";
+    std::string s;
+    std::getline(std::cin, s);
+    s = trim(s);
+    if (s.empty()) return def;
+    try { return std::stoll(s); }
+    catch (...) { return def; }
+}
+
+static fs::path askPath() {
+#ifdef _WIN32
+    // make console accept UTF-8 in many terminals
+    SetConsoleCP(CP_UTF8);
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+    std::cout << "Input file or folder path (you can paste / drag-drop):\n> ";
+    std::string in;
+    std::getline(std::cin, in);
+    in = trim(in);
+
+    // strip surrounding quotes
+    if (in.size() >= 2 && ((in.front() == '"' && in.back() == '"') || (in.front() == '\'' && in.back() == '\''))) {
+        in = in.substr(1, in.size() - 2);
+    }
+
+    // treat input as UTF-8
+    return pathFromUtf8(in);
+}
+
+// ---------- command line (batch mode) ----------
+static std::vector<std::string> commandLineArgs(int argc, char** argv) {
+    std::vector<std::string> args;
+#ifdef _WIN32
+    // argv is in the ANSI code page; take the UTF-16 command line instead
+    int wargc = 0;
+    LPWSTR* wargv = CommandLineToArgvW(GetCommandLineW(), &wargc);
+    if (wargv) {
+        for (int i = 1; i < wargc; ++i) args.push_back(wideToUtf8(wargv[i]));
+        LocalFree(wargv);
+        return args;
+    }
+#endif
+    for (int i = 1; i < argc; ++i) args.push_back(argv[i]);
+    return args;
+}
+
+static void printUsage() {
+    std::cout <<
+        "Usage: photo_timefix [path] [options]\n"
+        "Without arguments all options are asked interactively.\n"
+        "\n"
+        "  --apply                 change files (default: dry-run)\n"
+        "  --no-recursive          scan only the top folder\n"
+        "  --no-filename-shot      do not use filename timestamps as shot time (anchor)\n"
+        "  --no-filename-override  do not override target by filename timestamp\n"
+        "  --override-days N       filename override threshold days (default 7)\n"
+        "  --gap-days N            anchor gap limit days (default 90)\n"
+        "  --no-one-side-step      no +1s steps when only one anchor exists\n"
+        "  --sequential-dedup      make duplicate targets unique by +1s bumps in timeline order\n"
+        "                          (default: nearest free second, anchors keep theirs)\n"
+        "  --no-exif               do not write missing EXIF shot time\n"
+        "  --exif-rewrite          always let Exiv2 rewrite the file (default: add the dates in place when possible)\n"
+        "  --keep-metadata N       keep the parsed metadata of up to N files from read to EXIF write (default 1024)\n"
+        "  --no-reflink            write EXIF directly, not to a reflink clone swapped in atomically (Linux)\n"
+        "  --reflink-backup        keep the original of reflink EXIF writes as <file>.orig (no extra space)\n"
+        "  --xmp-sidecar           write missing dates to <file>.xmp instead of the file (photos and videos)\n"
+        "                          and use dates from existing sidecars as shot time\n"
+        "  --no-fs-times           do not sync filesystem times\n"
+        "  --keep-page-cache       leave what the metadata reads cached in the page cache\n"
+        "                          (default: read JPEG headers directly, drop the pages read afterwards; Linux)\n"
+        "  --quiet                 no per-file error details\n"
+        "  --report FORMAT         per-file report: none (default), human, jsonl or csv\n"
+        "                          (interactive runs: human)\n"
+        "  --report-file FILE      write the per-file report to FILE instead of standard output\n"
+        "  --progress              status line with files/s, MB/s and ETA on stderr (default when\n"
+        "                          stderr is a terminal); --no-progress turns it off\n"
+        "  --progress-json N       JSON progress line on stderr every N seconds\n"
+        "  --stats FILE            write time and storage I/O per stage and counters (system calls,\n"
+        "                          bytes, Exiv2 opens, exceptions, regex calls, allocations) as JSON\n"
+        "                          with read/apply latency per format and device and the slowest files\n"
+        "  --slowest N             number of slowest files in --stats (default 10)\n"
+        "  --trace FILE            write what each thread did when (stages, folders, file batches, waits)\n"
+        "                          as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)\n"
+        "  --index FILE            write the anchor index after the run\n"
+        "  --query FILE            print the target FILE would get, using the anchor index\n"
+        "                          (--index FILE, <path>/" << kAnchorIndexFileName << " or the nearest one above FILE)\n"
+        "  --index-update          with --query: also add FILE to the index\n"
+        "  --incremental           with --index: reuse the previous index, re-plan only changed segments\n"
+        "                          and skip files whose target is already applied\n"
+        "  --journal FILE          record what --apply changes in FILE first (crash-safe, for --rollback)\n"
+        "  --journal-sync N        journal records per disk sync (default 256)\n"
+        "  --rollback FILE         undo the run recorded in journal FILE (no path needed)\n"
+        "  --plan FILE             dry-run: also write the plan to FILE (binary) for --apply-plan\n"
+        "  --apply-plan FILE       apply a plan without scanning (no path needed); files changed\n"
+        "                          since the plan are skipped\n"
+        "  --jobs N                parallel file writes per device (default 4; spinning disks on Linux: 1)\n"
+        "  --device-jobs PATH=N    parallel writes for the device PATH is on (repeatable)\n"
+        "  --ioprio CLASS          I/O priority: idle, or be[:0-7] for best-effort (Linux; Windows: idle only)\n"
+        "  --max-files-per-sec N   read and apply at most N files per second (all threads together)\n"
+        "  --max-read-mb N         read at most N MB per second from storage (all threads together)\n"
+        "  --max-write-mb N        write at most N MB per second to storage (all threads together)\n"
+        "  --latency-target MS     lower the caps while files take longer than MS milliseconds,\n"
+        "                          raise them again when the device is fast\n"
+        "\n"
+        "Benchmark: photo_timefix --bench DIR [--bench-* options] [options for the runs]\n"
+        "  generates a synthetic tree in DIR/tree (reused while the parameters match), runs a dry-run plan,\n"
+        "  a dry-run with a JSON Lines report and an apply on it, and writes files/s, peak RSS and\n"
+        "  per-stage times to DIR/bench.json\n"
+        "  --bench-files N         files in the tree (default 10000)\n"
+        "  --bench-depth N         folder levels (default 2)\n"
+        "  --bench-fanout N        subfolders per folder (default 8)\n"
+        "  --bench-seed N          random seed; the same parameters give the same tree (default 1)\n"
+        "  --bench-exif PCT        files with an embedded date (default 60)\n"
+        "  --bench-kb N            image data per file in KB (default 4)\n"
+        "  --bench-formats LIST    format mix (default jpg=50,heic=10,png=10,mp4=20,mkv=10)\n"
+        "  --bench-names LIST      filename mix (default camera=40,screenshot=15,dashed=15,plain=30)\n"
+        "  --bench-runs LIST       runs, of plan,report,apply (default all)\n"
+        "  --bench-regenerate      generate the tree even if it matches\n"
+        "  --bench-out FILE        results file (default DIR/bench.json)\n"
+        "  --bench-baseline FILE   compare with an earlier results file; exit code 3 on regressions\n"
+        "  --bench-threshold PCT   regression threshold (default 10)\n"
+        "  --bench-scale N         run apply with --jobs 1, 2, 4, ... N and print speedup and efficiency per stage\n"
+        "                          (plan and report run once per cache state: --jobs affects only apply)\n"
+        "  --bench-cache LIST      page cache before each run, of cold,warm (default with --bench-scale: both)\n"
+        "\n"
+        "Test corpus: photo_timefix --corpus DIR [--corpus-files N] [--corpus-seed N] [--corpus-kinds LIST]\n"
+        "             [--corpus-damaged PCT]; photo_timefix --corpus-check DIR\n"
+        "  writes N (default 600) minimal jpg/tiff/png/heic/mp4/mkv files with known dates and varied layouts\n"
+        "  (byte order, APP1 offset and padding, HEIC extents, moov position; PCT truncated or corrupt, default 10)\n"
+        "  listed in DIR/corpus.tsv; --corpus-check reads them back and reports the dates found per layout\n"
+        "\n"
+        "Microbenchmarks: photo_timefix --microbench [--micro-threads N] [--micro-seconds S] [--micro-filter TEXT]\n"
+        "                 [--micro-out FILE]\n"
+        "  times the filename and date helpers per call with 1 and N threads (default: all CPUs, 0.5 s each)\n";
+}
+
+// returns -1 to continue, otherwise the exit code
+static int parseCommandLine(const std::vector<std::string>& args, Options& opt, fs::path& root) {
+    auto value = [&](size_t& i) -> const std::string* {
+        if (i + 1 >= args.size()) {
+            std::cout << "Missing value for " << args[i] << "\n";
+            return nullptr;
+        }
+        return &args[++i];
+    };
+    auto intValue = [&](size_t& i, long long& out) -> bool {
+        const std::string* v = value(i);
+        if (!v) return false;
+        try { out = std::stoll(*v); }
+        catch (...) {
+            std::cout << "Invalid number for " << args[i - 1] << ": " << *v << "\n";
+            return false;
+        }
+        return true;
+    };
+
+    opt.dropPageCache = true; // unattended runs share the machine: do not leave metadata reads in the page cache
+    opt.reportFormat = ReportFormat::None;
+    opt.progress = stderrIsTerminal();
+    bool progressSet = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a == "-h" || a == "--help") { printUsage(); return 0; }
+        else if (a == "--apply") opt.dryRun = false;
+        else if (a == "--dry-run") opt.dryRun = true;
+        else if (a == "--no-recursive") opt.recursive = false;
+        else if (a == "--no-filename-shot") opt.enableFilenameFallbackForShot = false;
+        else if (a == "--no-filename-override") opt.enableFilenameOverrideForTarget = false;
+        else if (a == "--override-days") { if (!intValue(i, opt.filenameOverrideDays)) return 2; }
+        else if (a == "--gap-days") { if (!intValue(i, opt.anchorGapLimitDays)) return 2; }
+        else if (a == "--no-one-side-step") opt.oneSideStep = false;
+        else if (a == "--sequential-dedup") opt.sequentialDedup = true;
+        else if (a == "--no-exif") opt.writeExifIfMissing = false;
+        else if (a == "--exif-rewrite") opt.exifInPlace = false;
+        else if (a == "--xmp-sidecar") opt.xmpSidecar = true;
+        else if (a == "--no-reflink") opt.reflinkRewrite = false;
+        else if (a == "--reflink-backup") opt.reflinkBackup = true;
+        else if (a == "--no-fs-times") opt.syncFileTimes = false;
+        else if (a == "--keep-page-cache") opt.dropPageCache = false;
+        else if (a == "--quiet") opt.verbose = false;
+        else if (a == "--report") {
+            const std::string* v = value(i);
+            if (!v) return 2;
+            if (*v == "none") opt.reportFormat = ReportFormat::None;
+            else if (*v == "human") opt.reportFormat = ReportFormat::Human;
+            else if (*v == "jsonl") opt.reportFormat = ReportFormat::Jsonl;
+            else if (*v == "csv") opt.reportFormat = ReportFormat::Csv;
+            else {
+                std::cout << "Invalid value for --report (none, human, jsonl or csv): " << *v << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--progress" || a == "--no-progress") {
+            opt.progress = a == "--progress";
+            progressSet = true;
+        }
+        else if (a == "--progress-json") {
+            long long n = 0;
+            if (!intValue(i, n)) return 2;
+            opt.progressJsonEvery = (double)std::max(1LL, n);
+        }
+        else if (a == "--report-file" || a == "--stats" || a == "--trace") {
+            const std::string* v = value(i);
+            if (!v) return 2;
+            (a == "--stats" ? opt.statsPath : a == "--trace" ? opt.tracePath : opt.reportPath) = pathFromUtf8(*v);
+        }
+        else if (a == "--index" || a == "--query" || a == "--journal" || a == "--rollback" || a == "--plan"
+            || a == "--apply-plan") {
+            const std::string* v = value(i);
+            if (!v) return 2;
+            (a == "--index" ? opt.indexPath : a == "--query" ? opt.queryFile
+                : a == "--journal" ? opt.journalPath : a == "--rollback" ? opt.rollbackPath
+                : a == "--plan" ? opt.planPath : opt.applyPlanPath) = pathFromUtf8(*v);
+        }
+        else if (a == "--journal-sync") {
+            long long n = 0;
+            if (!intValue(i, n)) return 2;
+            opt.journalSyncEvery = (size_t)std::max(1LL, n);
+        }
+        else if (a == "--index-update") opt.indexUpdate = true;
+        else if (a == "--incremental") opt.incremental = true;
+        else if (a == "--keep-metadata") {
+            long long n = 0;
+            if (!intValue(i, n)) return 2;
+            opt.keepMetadata = (size_t)std::max(0LL, n);
+        }
+        else if (a == "--slowest") {
+            long long n = 0;
+            if (!intValue(i, n)) return 2;
+            opt.slowestFiles = (size_t)std::max(0LL, n);
+        }
+        else if (a == "--jobs") {
+            long long n = 0;
+            if (!intValue(i, n)) return 2;
+            opt.applyJobs = (int)std::clamp(n, 1LL, 256LL);
+        }
+        else if (a == "--device-jobs") {
+            const std::string* v = value(i);
+            if (!v) return 2;
+            size_t eq = v->rfind('=');
+            int n = 0;
+            try { n = eq == std::string::npos ? 0 : std::stoi(v->substr(eq + 1)); }
+            catch (...) { n = 0; }
+            if (n < 1) {
+                std::cout << "Invalid value for --device-jobs (PATH=N): " << *v << "\n";
+                return 2;
+            }
+            opt.deviceJobs.emplace_back(pathFromUtf8(v->substr(0, eq)), std::min(n, 256));
+        }
+        else if (a == "--ioprio") {
+            const std::string* v = value(i);
+            if (!v) return 2;
+            if (*v == "idle") opt.ioPriorityClass = 3;
+            else if (*v == "be" || (v->size() == 4 && v->compare(0, 3, "be:") == 0 && (*v)[3] >= '0' && (*v)[3] <= '7')) {
+                opt.ioPriorityClass = 2;
+                if (v->size() == 4) opt.ioPriorityLevel = (*v)[3] - '0';
+            }
+            else {
+                std::cout << "Invalid value for --ioprio (idle, be or be:0-7): " << *v << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--max-files-per-sec" || a == "--max-read-mb" || a == "--max-write-mb" || a == "--latency-target") {
+            long long n = 0;
+            if (!intValue(i, n)) return 2;
+            const double x = (double)std::max(0LL, n);
+            if (a == "--max-files-per-sec") opt.maxFilesPerSec = x;
+            else if (a == "--max-read-mb") opt.maxReadBytesPerSec = x * 1000000;
+            else if (a == "--max-write-mb") opt.maxWriteBytesPerSec = x * 1000000;
+            else opt.latencyTargetMs = x;
+        }
+        else if (!a.empty() && a[0] == '-') {
+            std::cout << "Unknown option: " << a << "\n";
+            printUsage();
+            return 2;
+        }
+        else if (root.empty()) root = pathFromUtf8(a);
+        else {
+            std::cout << "Unexpected argument: " << a << "\n";
+            return 2;
+        }
+    }
+    // a per-file report on the same terminal would be torn up by the status line
+    if (!progressSet && opt.reportFormat != ReportFormat::None && opt.reportPath.empty()) opt.progress = false;
+    return -1;
+}
+
+// ---------- synthetic media (--corpus, --bench) ----------
+// Minimal valid files with exactly known dates and controlled layouts, to benchmark the readers and check
+// them against Exiv2 without shipping real photos. EXIF dates are local time, MP4 and Matroska dates UTC.
+
+// deterministic on every platform (std:: distributions are not)
+struct SplitMix64 {
+    uint64_t state;
+
+    explicit SplitMix64(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint64_t below(uint64_t n) { return n ? next() % n : 0; }
+    bool chance(int percent) { return (int)below(100) < percent; }
+};
+
+enum class MediaDamage { None, Truncated, Corrupt };
+
+struct MediaLayout {
+    std::string kind = "jpg";          // jpg, tiff, png, heic, mp4, mkv
+    bool bigEndian = false;            // TIFF byte order (JPEG APP1, TIFF, PNG eXIf, HEIC Exif item)
+    size_t app1At = 20;                // JPEG: offset of APP1 (other APPn segments before it)
+    size_t exifPadding = 0;            // JPEG: unused bytes at the end of APP1
+    int heicExtents = 1;               // HEIC: extents of the Exif item (2: split around the image data)
+    bool moovAtEnd = false;            // MP4: moov after mdat (no "fast start")
+    size_t dataBytes = 4096;           // image or media data
+    MediaDamage damage = MediaDamage::None;
+
+    // the layout choices that apply to the kind, e.g. "be app1@9020 pad512"
+    std::string text() const {
+        std::string s;
+        auto add = [&](const std::string& part) { s += (s.empty() ? "" : " ") + part; };
+        if (kind == "jpg" || kind == "tiff" || kind == "png" || kind == "heic") add(bigEndian ? "be" : "le");
+        if (kind == "jpg") {
+            add("app1@" + std::to_string(app1At));
+            add("pad" + std::to_string(exifPadding));
+        }
+        if (kind == "heic") add("extents" + std::to_string(heicExtents));
+        if (kind == "mp4") add(moovAtEnd ? "moov-end" : "moov-front");
+        return s;
+    }
+    const char* extension() const { return kind == "tiff" ? "tif" : kind.c_str(); }
+};
+
+struct SyntheticFile {
+    std::string data;
+    size_t metaBegin = 0, metaEnd = 0; // the structure that carries the date (what damage hits)
+};
+
+static void putBe16(std::string& out, uint16_t v) {
+    out += (char)(v >> 8);
+    out += (char)v;
+}
+static void putBe32(std::string& out, uint32_t v) {
+    putBe16(out, (uint16_t)(v >> 16));
+    putBe16(out, (uint16_t)v);
+}
+static void putBe64(std::string& out, uint64_t v) {
+    putBe32(out, (uint32_t)(v >> 32));
+    putBe32(out, (uint32_t)v);
+}
+static void patchBe32(std::string& out, size_t at, uint32_t v) {
+    std::string b;
+    putBe32(b, v);
+    out.replace(at, 4, b);
+}
+
+static uint32_t crc32Of(const char* data, size_t n) {
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; ++i) {
+        c ^= (unsigned char)data[i];
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+    }
+    return ~c;
+}
+
+// TIFF structure, offsets relative to its start: IFD0 (with a width 1 grey strip of imageBytes when > 0, i.e. a
+// standalone TIFF) pointing to an Exif IFD with DateTimeOriginal. No Exif IFD when exifDate is empty.
+static std::string syntheticTiff(const std::string& exifDate, bool bigEndian, size_t imageBytes) {
+    std::string t;
+    auto u16 = [&](uint16_t v) {
+        if (bigEndian) putBe16(t, v);
+        else { t += (char)v; t += (char)(v >> 8); }
+        };
+    auto u32 = [&](uint32_t v) {
+        if (bigEndian) putBe32(t, v);
+        else { u16((uint16_t)v); u16((uint16_t)(v >> 16)); }
+        };
+    auto entry = [&](uint16_t tag, uint16_t type, uint32_t count, uint32_t value) {
+        u16(tag); u16(type); u32(count);
+        if (type == 3) { u16((uint16_t)value); u16(0); } // SHORT: left-justified in the value field
+        else u32(value);
+        };
+    const bool hasExif = !exifDate.empty();
+    const uint16_t entries = (uint16_t)((imageBytes ? 9 : 0) + (hasExif ? 1 : 0));
+    const uint32_t exifIfd = 8 + 2 + 12u * entries + 4, dateAt = exifIfd + (hasExif ? 18 : 0);
+    const uint32_t stripAt = dateAt + (hasExif ? 20 : 0), rows = (uint32_t)imageBytes;
+    t += bigEndian ? "MM" : "II";
+    u16(42);
+    u32(8);
+    u16(entries);
+    if (imageBytes) {
+        entry(0x0100, 3, 1, 1);          // ImageWidth
+        entry(0x0101, 4, 1, rows);       // ImageLength
+        entry(0x0102, 3, 1, 8);          // BitsPerSample
+        entry(0x0103, 3, 1, 1);          // Compression: none
+        entry(0x0106, 3, 1, 1);          // PhotometricInterpretation: black is zero
+        entry(0x0111, 4, 1, stripAt);    // StripOffsets
+        entry(0x0115, 3, 1, 1);          // SamplesPerPixel
+        entry(0x0116, 4, 1, rows);       // RowsPerStrip
+        entry(0x0117, 4, 1, rows);       // StripByteCounts
+    }
+    if (hasExif) entry(0x8769, 4, 1, exifIfd);
+    u32(0);
+    if (hasExif) {
+        u16(1);
+        entry(0x9003, 2, 20, dateAt);    // DateTimeOriginal
+        u32(0);
+        t += exifDate;
+        t.resize(stripAt, '\0');
+    }
+    t.append(imageBytes, '\x80');
+    return t;
+}
+
+// 1x1 grey baseline frame: DQT, SOF0, DHT (DC, AC), SOS and its one-byte scan
+static const char kJpegFrame[] =
+        "\xFF\xDB\x00\x43\x00\x10\x0B\x0C\x0E\x0C\x0A\x10\x0E\x0D\x0E\x12\x11\x10\x13\x18\x28\x1A\x18\x16"
+        "\x16\x18\x31\x23\x25\x1D\x28\x3A\x33\x3D\x3C\x39\x33\x38\x37\x40\x48\x5C\x4E\x40\x44\x57\x45\x37"
+        "\x38\x50\x6D\x51\x57\x5F\x62\x67\x68\x67\x3E\x4D\x71\x79\x70\x64\x78\x5C\x65\x67\x63\xFF\xC0\x00"
+        "\x0B\x08\x00\x01\x00\x01\x01\x01\x11\x00\xFF\xC4\x00\x14\x00\x01\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x00\x00\x00\x00\xFF\xC4\x00\x14\x10\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x00\x00\xFF\xDA\x00\x08\x01\x01\x00\x00\x3F\x00\x3F";
+
+// JPEG: SOI, JFIF, APP15 filler up to app1At, APP1 Exif (+ padding), 1x1 frame, dataBytes more scan data, EOI
+static SyntheticFile syntheticJpeg(const std::string& exifDate, const MediaLayout& l) {
+    SyntheticFile f;
+    f.data.assign("\xFF\xD8\xFF\xE0\x00\x10JFIF\x00\x01\x01\x00\x00\x01\x00\x01\x00\x00", 20);
+    for (size_t gap = l.app1At > f.data.size() ? l.app1At - f.data.size() : 0; gap >= 4;) {
+        size_t segment = std::min<size_t>(gap, 2 + 65535);
+        if (gap - segment > 0 && gap - segment < 4) segment = gap - 4; // leave room for a whole segment
+        f.data += "\xFF\xEF";
+        putBe16(f.data, (uint16_t)(segment - 2));
+        f.data.append(segment - 4, '\0');
+        gap -= segment;
+    }
+    if (!exifDate.empty()) {
+        const std::string tiff = syntheticTiff(exifDate, l.bigEndian, 0);
+        const size_t padding = std::min(l.exifPadding, 65535 - 8 - tiff.size());
+        f.metaBegin = f.data.size();
+        f.data += "\xFF\xE1";
+        putBe16(f.data, (uint16_t)(2 + 6 + tiff.size() + padding));
+        f.data.append("Exif\0\0", 6);
+        f.data += tiff;
+        f.metaEnd = f.data.size();
+        f.data.append(padding, '\0');
+    }
+    f.data.append(kJpegFrame, sizeof(kJpegFrame) - 1);
+    f.data.append(l.dataBytes, '\x55');
+    f.data += "\xFF\xD9";
+    return f;
+}
+
+static SyntheticFile syntheticTiffFile(const std::string& exifDate, const MediaLayout& l) {
+    SyntheticFile f;
+    f.data = syntheticTiff(exifDate, l.bigEndian, std::max<size_t>(1, l.dataBytes));
+    if (!exifDate.empty()) f.metaEnd = f.data.size() - std::max<size_t>(1, l.dataBytes);
+    return f;
+}
+
+// PNG: 1x1 grey pixel, eXIf chunk with the date, private chunk of dataBytes
+static SyntheticFile syntheticPng(const std::string& exifDate, const MediaLayout& l) {
+    SyntheticFile f;
+    f.data.assign("\x89PNG\r\n\x1A\n", 8);
+    auto chunk = [&](const char* type, const std::string& data) {
+        putBe32(f.data, (uint32_t)data.size());
+        const size_t at = f.data.size();
+        f.data.append(type, 4);
+        f.data += data;
+        putBe32(f.data, crc32Of(f.data.data() + at, 4 + data.size()));
+        };
+    chunk("IHDR", std::string("\x00\x00\x00\x01\x00\x00\x00\x01\x08\x00\x00\x00\x00", 13));
+    if (!exifDate.empty()) {
+        f.metaBegin = f.data.size();
+        chunk("eXIf", syntheticTiff(exifDate, l.bigEndian, 0));
+        f.metaEnd = f.data.size();
+    }
+    chunk("IDAT", std::string("\x78\x01\x01\x02\x00\xFD\xFF\x00\x00\x00\x02\x00\x01", 13));
+    chunk("ptfD", std::string(l.dataBytes, '\x55'));
+    chunk("IEND", std::string());
+    return f;
+}
+
+static std::string isoBox(const char* type, const std::string& payload) {
+    std::string b;
+    putBe32(b, (uint32_t)(8 + payload.size()));
+    b.append(type, 4);
+    return b + payload;
+}
+static std::string isoFullBox(const char* type, uint8_t version, const std::string& payload) {
+    std::string p(1, (char)version);
+    p.append(3, '\0'); // flags
+    return isoBox(type, p + payload);
+}
+
+// HEIF: ftyp, meta (hdlr, pitm, iinf with an hvc1 image item and an Exif item, iloc), mdat with both items.
+// With two extents the Exif item is split around the image data.
+static SyntheticFile syntheticHeic(const std::string& exifDate, const MediaLayout& l) {
+    SyntheticFile f;
+    std::string exif;
+    if (!exifDate.empty()) {
+        putBe32(exif, 6); // exif_tiff_header_offset
+        exif.append("Exif\0\0", 6);
+        exif += syntheticTiff(exifDate, l.bigEndian, 0);
+    }
+    const bool split = !exif.empty() && l.heicExtents > 1;
+    const uint16_t items = exif.empty() ? 1 : 2;
+
+    std::string ftyp("heic", 4);
+    putBe32(ftyp, 0);
+    ftyp.append("mif1heic", 8);
+    std::string hdlr(4, '\0');
+    hdlr += "pict";
+    hdlr.append(13, '\0');
+    std::string pitm, iinf, iloc;
+    putBe16(pitm, 1);
+    putBe16(iinf, items);
+    for (uint16_t id = 1; id <= items; ++id) {
+        std::string infe;
+        putBe16(infe, id);
+        putBe16(infe, 0);
+        infe += id == 1 ? "hvc1" : "Exif";
+        infe += '\0';
+        iinf += isoFullBox("infe", 2, infe);
+    }
+    // iloc v0: 4-byte offsets and lengths, no base offset; offsets patched below
+    iloc += '\x44';
+    iloc += '\0';
+    putBe16(iloc, items);
+    std::vector<size_t> offsetFields;
+    for (uint16_t id = 1; id <= items; ++id) {
+        putBe16(iloc, id);
+        putBe16(iloc, 0);
+        const int extents = id == 2 && split ? 2 : 1;
+        putBe16(iloc, (uint16_t)extents);
+        for (int e = 0; e < extents; ++e) {
+            offsetFields.push_back(iloc.size());
+            putBe32(iloc, 0);
+            putBe32(iloc, 0);
+        }
+    }
+    const std::string ilocBox = isoFullBox("iloc", 0, iloc);
+    const std::string meta = isoFullBox("meta", 0, isoFullBox("hdlr", 0, hdlr) + isoFullBox("pitm", 0, pitm)
+        + isoFullBox("iinf", 0, iinf) + ilocBox);
+    f.data = isoBox("ftyp", ftyp) + meta;
+    const size_t ilocAt = f.data.size() - ilocBox.size() + 12; // iloc payload after the full box header
+
+    // mdat: [exif part 1] image [exif part 2] (one extent: image, exif)
+    const size_t half = split ? exif.size() / 2 : 0;
+    putBe32(f.data, (uint32_t)(8 + l.dataBytes + exif.size()));
+    f.data += "mdat";
+    const size_t exif1 = f.data.size();
+    f.data += exif.substr(0, half);
+    const size_t image = f.data.size();
+    f.data.append(l.dataBytes, '\x55');
+    const size_t exif2 = f.data.size();
+    f.data += exif.substr(half);
+    std::vector<std::pair<size_t, size_t>> extents{ { image, l.dataBytes } };
+    if (split) {
+        extents.emplace_back(exif1, half);
+        extents.emplace_back(exif2, exif.size() - half);
+    }
+    else if (!exif.empty()) extents.emplace_back(exif2, exif.size());
+    for (size_t e = 0; e < offsetFields.size(); ++e) {
+        patchBe32(f.data, ilocAt + offsetFields[e], (uint32_t)extents[e].first);
+        patchBe32(f.data, ilocAt + offsetFields[e] + 4, (uint32_t)extents[e].second);
+    }
+    if (!exif.empty()) {
+        f.metaBegin = split ? exif1 : exif2;
+        f.metaEnd = split ? exif1 + half : exif2 + exif.size();
+    }
+    return f;
+}
+
+// MP4: ftyp, moov with mvhd (creation and modification time: seconds since 1904 UTC, 0 = unknown) before or
+// after mdat
+static SyntheticFile syntheticMp4(std::time_t date, bool hasDate, const MediaLayout& l) {
+    SyntheticFile f;
+    std::string ftyp("isom", 4);
+    putBe32(ftyp, 0x200);
+    ftyp.append("isomiso2mp41", 12);
+    f.data = isoBox("ftyp", ftyp);
+    std::string mvhd;
+    const uint32_t t = hasDate ? (uint32_t)((int64_t)date + 2082844800) : 0;
+    putBe32(mvhd, t);
+    putBe32(mvhd, t);
+    putBe32(mvhd, 1000); // timescale
+    putBe32(mvhd, 0);    // duration
+    putBe32(mvhd, 0x00010000);
+    putBe16(mvhd, 0x0100);
+    mvhd.append(10, '\0');
+    for (uint32_t m : { 0x10000u, 0u, 0u, 0u, 0x10000u, 0u, 0u, 0u, 0x40000000u }) putBe32(mvhd, m);
+    mvhd.append(24, '\0');
+    putBe32(mvhd, 1);    // next_track_ID
+    const std::string moov = isoBox("moov", isoFullBox("mvhd", 0, mvhd));
+    const std::string mdat = isoBox("mdat", std::string(l.dataBytes, '\x55'));
+    if (l.moovAtEnd) f.data += mdat;
+    f.metaBegin = f.data.size();
+    f.data += moov;
+    f.metaEnd = f.data.size();
+    if (!l.moovAtEnd) f.data += mdat;
+    return f;
+}
+
+// EBML element with an 8-byte size
+static std::string ebml(uint32_t id, const std::string& payload) {
+    std::string e;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if ((id >> shift) || !e.empty()) e += (char)(id >> shift);
+    }
+    putBe64(e, (uint64_t)payload.size() | (1ULL << 56));
+    return e + payload;
+}
+
+// Matroska: EBML header, Segment with Info (DateUTC: ns since 2001-01-01 UTC) and a Void of dataBytes
+static SyntheticFile syntheticMatroska(std::time_t date, bool hasDate, const MediaLayout& l) {
+    SyntheticFile f;
+    auto uintElement = [](uint32_t id, uint64_t v, int bytes) {
+        std::string p;
+        for (int i = bytes - 1; i >= 0; --i) p += (char)(v >> (8 * i));
+        return ebml(id, p);
+        };
+    f.data = ebml(0x1A45DFA3, uintElement(0x4286, 1, 1) + uintElement(0x42F7, 1, 1) + uintElement(0x42F2, 4, 1)
+        + uintElement(0x42F3, 8, 1) + ebml(0x4282, "matroska") + uintElement(0x4287, 4, 1) + uintElement(0x4285, 2, 1));
+    std::string info = uintElement(0x2AD7B1, 1000000, 3); // TimecodeScale
+    if (hasDate) info += uintElement(0x4461, (uint64_t)(((int64_t)date - 978307200) * 1000000000LL), 8);
+    info += ebml(0x4D80, "photo_timefix") + ebml(0x5741, "photo_timefix");
+    const std::string infoElement = ebml(0x1549A966, info);
+    const size_t segmentPayload = f.data.size() + 4 + 8;
+    f.data += ebml(0x18538067, infoElement + ebml(0xEC, std::string(l.dataBytes, '\0')));
+    if (hasDate) {
+        f.metaBegin = segmentPayload;
+        f.metaEnd = segmentPayload + infoElement.size();
+    }
+    return f;
+}
+
+// hasDate false: a file of the kind without any date. Damage hits the middle of the date structure: truncated
+// there, or 16 bytes overwritten.
+static SyntheticFile makeSyntheticFile(const MediaLayout& l, std::time_t date, bool hasDate) {
+    const std::string exifDate = hasDate ? toExifString(date) : std::string();
+    SyntheticFile f = l.kind == "jpg" ? syntheticJpeg(exifDate, l)
+        : l.kind == "tiff" ? syntheticTiffFile(exifDate, l)
+        : l.kind == "png" ? syntheticPng(exifDate, l)
+        : l.kind == "heic" ? syntheticHeic(exifDate, l)
+        : l.kind == "mp4" ? syntheticMp4(date, hasDate, l)
+        : syntheticMatroska(date, hasDate, l);
+    if (l.damage != MediaDamage::None && f.metaEnd > f.metaBegin) {
+        const size_t mid = f.metaBegin + (f.metaEnd - f.metaBegin) / 2;
+        if (l.damage == MediaDamage::Truncated) f.data.resize(mid);
+        else {
+            const size_t from = std::max(f.metaBegin, mid - std::min<size_t>(mid, 8));
+            std::fill(f.data.begin() + from, f.data.begin() + std::min(f.metaEnd, from + 16), '\xFF');
+        }
+    }
+    return f;
+}
+
+static bool writeWholeFile(const fs::path& file, const std::string& data) {
+    RandomAccessFile f;
+    return f.create(file) && f.writeAt(0, data.data(), data.size());
+}
+
+static const std::vector<std::string> kSyntheticKinds{ "jpg", "tiff", "png", "heic", "mp4", "mkv" };
+static constexpr const char* kCorpusManifestName = "corpus.tsv";
+
+// --corpus DIR: count files with random kinds, layouts and dates, listed in DIR/corpus.tsv as
+// name, kind, layout, damage and the date (UTC seconds, "-" for none)
+static int generateCorpus(const fs::path& dir, uint64_t count, uint64_t seed, const std::vector<std::string>& kinds,
+    int damagedPercent) {
+    SplitMix64 rng(seed);
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    std::ofstream manifest(dir / kCorpusManifestName, std::ios::binary | std::ios::trunc);
+    manifest << "# name\tkind\tlayout\tdamage\tdate\n";
+    for (uint64_t i = 0; i < count; ++i) {
+        MediaLayout l;
+        l.kind = kinds[rng.below(kinds.size())];
+        l.bigEndian = rng.chance(50);
+        l.app1At = std::vector<size_t>{ 20, 1020, 9020, 70020 }[rng.below(4)];
+        l.exifPadding = std::vector<size_t>{ 0, 512, 4000 }[rng.below(3)];
+        l.heicExtents = rng.chance(50) ? 2 : 1;
+        l.moovAtEnd = rng.chance(50);
+        l.dataBytes = 1024 * (size_t)(1 + rng.below(16));
+        const bool hasDate = rng.chance(90);
+        if (hasDate && rng.chance(damagedPercent)) l.damage = rng.chance(50) ? MediaDamage::Truncated : MediaDamage::Corrupt;
+        const std::time_t date = 946684800 + (std::time_t)rng.below(25ULL * 365 * 86400); // 2000..2024
+        const char* damage = l.damage == MediaDamage::Truncated ? "truncated" : l.damage == MediaDamage::Corrupt ? "corrupt" : "-";
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "%06llu_%s.%s", (unsigned long long)i, l.kind.c_str(), l.extension());
+        if (!writeWholeFile(dir / name, makeSyntheticFile(l, date, hasDate).data)) {
+            std::cout << "Cannot write " << dir / name << "\n";
+            return 1;
+        }
+        manifest << name << '\t' << l.kind << '\t' << l.text() << '\t' << damage << '\t';
+        if (hasDate && l.damage == MediaDamage::None) manifest << (long long)date << '\n';
+        else manifest << "-\n";
+    }
+    if (!manifest.flush()) {
+        std::cout << "Cannot write " << dir / kCorpusManifestName << "\n";
+        return 1;
+    }
+    std::cout << "Corpus: " << count << " files in " << dir << ", listed in " << kCorpusManifestName << "\n";
+    return 0;
+}
+
+// --corpus-check DIR: reads every corpus file with the batch-mode reader (JPEG headers read directly, Linux)
+// and with Exiv2 on the whole file, and compares both with the date in the manifest. Damaged files have no
+// expected date; they must only not crash and both readers must agree. Exit code 1 on wrong dates or
+// disagreement; dates not found are counted (video containers are not read).
+static int checkCorpus(const fs::path& dir) {
+    std::ifstream manifest(dir / kCorpusManifestName, std::ios::binary);
+    if (!manifest) {
+        std::cout << "Cannot read " << dir / kCorpusManifestName << "\n";
+        return 1;
+    }
+    struct Row {
+        uint64_t files = 0, correct = 0, missing = 0, wrong = 0, unexpected = 0, disagree = 0;
+        double fastSeconds = 0, fullSeconds = 0;
+    };
+    std::map<std::string, Row> rows;
+    std::vector<std::string> problems;
+    PageCacheStats pageCache;
+    Exiv2::XmpParser::initialize();
+    for (std::string line; std::getline(manifest, line);) {
+        if (line.empty() || line[0] == '#') continue;
+        std::vector<std::string> fields;
+        std::istringstream in(line);
+        for (std::string field; std::getline(in, field, '\t');) fields.push_back(field);
+        if (fields.size() < 5) continue;
+        const fs::path file = dir / pathFromUtf8(fields[0]);
+        std::optional<std::time_t> expected;
+        if (fields[4] != "-") expected = (std::time_t)std::stoll(fields[4]);
+
+        auto t0 = std::chrono::steady_clock::now();
+        const auto fast = readShotTimeFromMetadata(file, nullptr, nullptr, &pageCache);
+        auto t1 = std::chrono::steady_clock::now();
+        const auto full = readShotTimeFromMetadata(file);
+        auto t2 = std::chrono::steady_clock::now();
+
+        std::vector<std::string> keys;
+        if (fields[3] != "-") keys.push_back(fields[1] + " " + fields[3]);
         else {
-            // no anchors at all: leave empty
-            for (int j = 0; j < m; ++j) {
-                // nothing
+            keys.push_back(fields[1]);
+            std::istringstream parts(fields[2]);
+            for (std::string part; parts >> part;) keys.push_back(fields[1] + " " + part);
+        }
+        for (const auto& key : keys) {
+            Row& r = rows[key];
+            r.files++;
+            r.fastSeconds += std::chrono::duration<double>(t1 - t0).count();
+            r.fullSeconds += std::chrono::duration<double>(t2 - t1).count();
+            if (fast != full) r.disagree++;
+            if (!expected) { if (full) r.unexpected++; }
+            else if (!full) r.missing++;
+            else if (*full == *expected) r.correct++;
+            else r.wrong++;
+        }
+        if (fast != full || (expected && full && *full != *expected)) problems.push_back(fields[0] + " (" + fields[1] + " " + fields[2] + ")");
+    }
+
+    std::cout << std::left << std::setw(22) << "kind / layout" << std::right << std::setw(7) << "files" << std::setw(9) << "correct"
+        << std::setw(9) << "missing" << std::setw(7) << "wrong" << std::setw(12) << "unexpected" << std::setw(10) << "disagree"
+        << std::setw(11) << "batch us" << std::setw(11) << "exiv2 us" << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for (const auto& kv : rows) {
+        const Row& r = kv.second;
+        std::cout << std::left << std::setw(22) << kv.first << std::right << std::setw(7) << r.files << std::setw(9) << r.correct
+            << std::setw(9) << r.missing << std::setw(7) << r.wrong << std::setw(12) << r.unexpected << std::setw(10) << r.disagree
+            << std::setw(11) << r.fastSeconds * 1e6 / (double)r.files << std::setw(11) << r.fullSeconds * 1e6 / (double)r.files << "\n";
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
+    for (size_t k = 0; k < problems.size() && k < 20; ++k) std::cout << "  wrong or disagreeing: " << problems[k] << "\n";
+    std::cout << (problems.empty() ? "No wrong dates.\n" : std::to_string(problems.size()) + " file(s) with wrong or disagreeing dates.\n");
+    return problems.empty() ? 0 : 1;
+}
+
+static int runCorpus(const std::vector<std::string>& args) {
+    fs::path dir;
+    bool check = false;
+    uint64_t count = 600, seed = 1;
+    int damagedPercent = 10;
+    std::vector<std::string> kinds = kSyntheticKinds;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (i + 1 >= args.size()) {
+            std::cout << "Missing value for " << a << "\n";
+            return 2;
+        }
+        const std::string& v = args[++i];
+        long long n = 0;
+        if (a == "--corpus-files" || a == "--corpus-seed" || a == "--corpus-damaged") {
+            try { n = std::stoll(v); }
+            catch (...) { n = -1; }
+            if (n < 0) {
+                std::cout << "Invalid number for " << a << ": " << v << "\n";
+                return 2;
+            }
+        }
+        if (a == "--corpus" || a == "--corpus-check") {
+            dir = pathFromUtf8(v);
+            check = a == "--corpus-check";
+        }
+        else if (a == "--corpus-files") count = (uint64_t)std::max(1LL, n);
+        else if (a == "--corpus-seed") seed = (uint64_t)n;
+        else if (a == "--corpus-damaged") damagedPercent = (int)std::min(100LL, n);
+        else if (a == "--corpus-kinds") {
+            kinds.clear();
+            std::istringstream in(v);
+            for (std::string k; std::getline(in, k, ',');) {
+                if (std::find(kSyntheticKinds.begin(), kSyntheticKinds.end(), k) == kSyntheticKinds.end()) {
+                    std::cout << "Invalid kind for --corpus-kinds (jpg, tiff, png, heic, mp4, mkv): " << k << "\n";
+                    return 2;
+                }
+                kinds.push_back(k);
             }
+            if (kinds.empty()) kinds = kSyntheticKinds;
+        }
+        else {
+            std::cout << "Unknown option: " << a << "\n";
+            return 2;
         }
     }
+    return check ? checkCorpus(dir) : generateCorpus(dir, count, seed, kinds, damagedPercent);
 }
-// ---------- make filled targets unique (+1s/+2s ...) ----------
-static void makeFilledTargetsStrictlyIncreasing(std::vector<Item>& items, const Options& opt) {
-    // assumes items already sorted by mtime
-    const long long step = std::max(1LL, opt.oneSideStepSeconds);
 
-    std::optional<std::time_t> prevTarget;
-    for (auto& it : items) {
-        if (!it.target) continue;
+// ---------- benchmark (--bench) ----------
+// photo_timefix --bench DIR [--bench-* ...] [other options]
+// Generates a reproducible synthetic media tree in DIR/tree (same spec and seed: same names, contents and times),
+// then runs this program on it as child processes: a dry-run plan, a dry-run with a JSON Lines report and an
+// apply. Each run's wall time, files/s, peak RSS and per-stage times (from --stats) go to DIR/bench.json;
+// --bench-baseline FILE compares them with an earlier bench.json. All other options are passed to the runs.
+
+using BenchWeights = std::vector<std::pair<std::string, int>>;
+
+struct BenchTreeSpec {
+    uint64_t files = 10000;
+    int depth = 2;                     // folder levels below the tree
+    int fanout = 8;                    // subfolders per folder
+    uint64_t seed = 1;
+    int exifPercent = 60;              // files with an embedded date (EXIF; MP4, MKV: container date)
+    int fileKb = 4;                    // image data per file
+    BenchWeights formats{ { "jpg", 50 }, { "heic", 10 }, { "png", 10 }, { "mp4", 20 }, { "mkv", 10 } };
+    BenchWeights names{ { "camera", 40 }, { "screenshot", 15 }, { "dashed", 15 }, { "plain", 30 } };
+
+    static std::string weightsText(const BenchWeights& w) {
+        std::string s;
+        for (const auto& kv : w) s += (s.empty() ? "" : ",") + kv.first + "=" + std::to_string(kv.second);
+        return s;
+    }
+    // the same text means the same tree
+    std::string text() const {
+        std::ostringstream s;
+        s << "v2 files=" << files << " depth=" << depth << " fanout=" << fanout << " seed=" << seed << " exif=" << exifPercent
+            << " kb=" << fileKb << " formats=" << weightsText(formats) << " names=" << weightsText(names);
+        return s.str();
+    }
+};
+
+// "jpg=50,png=10": false if a name is not in known or a weight is not a number
+static bool parseBenchWeights(const std::string& text, const std::vector<std::string>& known, BenchWeights& out) {
+    BenchWeights w;
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        const size_t eq = item.find('=');
+        const std::string name = item.substr(0, eq);
+        if (eq == std::string::npos || std::find(known.begin(), known.end(), name) == known.end()) return false;
+        try { w.emplace_back(name, std::max(0, std::stoi(item.substr(eq + 1)))); }
+        catch (...) { return false; }
+    }
+    int total = 0;
+    for (const auto& kv : w) total += kv.second;
+    if (total <= 0) return false;
+    out = std::move(w);
+    return true;
+}
 
-        // 只修正“需要推断出来的文件”：也就是原本没有 shot 的那批 ([FILL])
-        const bool isFilled = !it.shot.has_value();
+static const std::string& pickWeighted(const BenchWeights& w, SplitMix64& rng) {
+    int total = 0;
+    for (const auto& kv : w) total += kv.second;
+    int r = (int)rng.below((uint64_t)total);
+    for (const auto& kv : w) {
+        if (r < kv.second) return kv.first;
+        r -= kv.second;
+    }
+    return w.back().first;
+}
 
-        if (prevTarget && isFilled && *it.target <= *prevTarget) {
-            // bump to prev+step, prev+2step, ...
-            std::time_t bumped = (std::time_t)((long long)(*prevTarget) + step);
-            it.target = bumped;
+static std::string localTimeText(std::time_t t, const char* format) {
+    std::tm lt{};
+#ifdef _WIN32
+    localtime_s(&lt, &t);
+#else
+    localtime_r(&t, &lt);
+#endif
+    char buf[64];
+    return std::string(buf, std::strftime(buf, sizeof(buf), format, &lt));
+}
+
+static std::string syntheticFileName(const std::string& pattern, std::time_t t, uint64_t index, SplitMix64& rng) {
+    if (pattern == "camera") return localTimeText(t, "IMG_%Y%m%d_%H%M%S");
+    if (pattern == "screenshot") return localTimeText(t, "Screenshot_%Y%m%d-%H%M%S");
+    if (pattern == "dashed") {
+        char ms[8];
+        std::snprintf(ms, sizeof(ms), "-%03d", (int)rng.below(1000));
+        return localTimeText(t, "image-%Y-%m-%d-%H_%M_%S") + ms;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "file_%07llu", (unsigned long long)index);
+    return name;
+}
 
-            if (!it.targetReason.empty()) it.targetReason += " + ";
-            it.targetReason += "unique(+1s steps)";
+// Files in time order, spread over fanout^depth leaf folders so that each folder holds a stretch of the
+// timeline (like camera imports). Shot times start 2015-01-01 and are at least a second apart (names are
+// unique); most mtimes are a little after the shot, 15% were copied weeks or months later.
+static bool generateBenchTree(const fs::path& tree, const BenchTreeSpec& spec) {
+    SplitMix64 rng(spec.seed);
+    uint64_t leaves = 1;
+    for (int d = 0; d < spec.depth; ++d) leaves *= (uint64_t)spec.fanout;
+    const double span = 8.0 * 365 * 86400;                      // keep every time in the past
+    const uint64_t step = std::max<uint64_t>(1, std::min<uint64_t>(900, (uint64_t)(span / (double)std::max<uint64_t>(1, spec.files))));
+    const size_t dataBytes = (size_t)spec.fileKb * 1024;
+    std::time_t shot = 1420070400;
+    std::ostringstream none;
+    fs::path dir;
+    uint64_t dirLeaf = UINT64_MAX;
+    for (uint64_t i = 0; i < spec.files; ++i) {
+        shot += (std::time_t)(1 + rng.below(2 * step));
+        const uint64_t leaf = i * leaves / spec.files;
+        if (leaf != dirLeaf) {
+            dirLeaf = leaf;
+            dir = tree;
+            for (uint64_t d = 0, rest = leaf; d < (uint64_t)spec.depth; ++d, rest /= (uint64_t)spec.fanout) {
+                char part[16];
+                std::snprintf(part, sizeof(part), "%02d", (int)(rest % (uint64_t)spec.fanout));
+                dir /= part;
+            }
+            std::error_code ec;
+            fs::create_directories(dir, ec);
+            if (ec) return false;
         }
+        const std::string& format = pickWeighted(spec.formats, rng);
+        const std::string name = syntheticFileName(pickWeighted(spec.names, rng), shot, i, rng) + "." + format;
+        MediaLayout layout;
+        layout.kind = format;
+        layout.dataBytes = dataBytes;
+        const std::string data = makeSyntheticFile(layout, shot, rng.chance(spec.exifPercent)).data;
+        const std::time_t mtime = shot + (std::time_t)(rng.chance(15) ? 86400 * (10 + rng.below(390)) : rng.below(120));
+
+        const fs::path file = dir / name;
+        if (!writeWholeFile(file, data)) return false;
+#ifdef _WIN32
+        if (!setFileTimesWindows(file, mtime, false, none)) return false;
+#else
+        if (!setFileTimesPosix(-1, AT_FDCWD, file.c_str(), mtime, false, none)) return false;
+#endif
+    }
+    return true;
+}
 
-        // 更新 prevTarget：以“最终 target”为准
-        prevTarget = it.target;
+// Numbers of a JSON document by dotted path ("runs.plan.wall_seconds", arrays by index); enough for the
+// stats and bench files this program writes.
+struct JsonNumbers {
+    std::unordered_map<std::string, double> values;
+    std::string_view s;
+    size_t pos = 0;
+
+    bool parse(std::string_view text) {
+        s = text;
+        pos = 0;
+        return value("") && (space(), pos == s.size());
+    }
+
+    double get(const std::string& path, double def = -1) const {
+        auto it = values.find(path);
+        return it == values.end() ? def : it->second;
+    }
+
+private:
+    void space() { while (pos < s.size() && std::isspace((unsigned char)s[pos])) pos++; }
+    bool string(std::string* out) {
+        if (pos >= s.size() || s[pos] != '"') return false;
+        for (pos++; pos < s.size() && s[pos] != '"'; pos++) {
+            if (s[pos] == '\\') pos++;
+            else if (out) *out += s[pos];
+        }
+        return pos++ < s.size();
+    }
+    bool value(const std::string& path) {
+        space();
+        if (pos >= s.size()) return false;
+        const char c = s[pos];
+        if (c == '{' || c == '[') {
+            pos++;
+            space();
+            const char close = c == '{' ? '}' : ']';
+            for (size_t index = 0; pos < s.size() && s[pos] != close; ++index) {
+                std::string key = std::to_string(index);
+                if (c == '{') {
+                    key.clear();
+                    if (!string(&key)) return false;
+                    space();
+                    if (pos >= s.size() || s[pos++] != ':') return false;
+                }
+                if (!value(path.empty() ? key : path + "." + key)) return false;
+                space();
+                if (pos < s.size() && s[pos] == ',') { pos++; space(); }
+            }
+            return pos++ < s.size();
+        }
+        if (c == '"') return string(nullptr);
+        const size_t end = s.find_first_of(",}] \t\r\n", pos);
+        const std::string token(s.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+        pos = end == std::string_view::npos ? s.size() : end;
+        if (token == "true" || token == "false" || token == "null") return true;
+        char* stop = nullptr;
+        const double v = std::strtod(token.c_str(), &stop);
+        if (token.empty() || *stop) return false;
+        values[path] = v;
+        return true;
     }
+};
+
+static bool readJsonNumbers(const fs::path& file, JsonNumbers& out) {
+    std::ifstream in(file, std::ios::binary);
+    std::ostringstream text;
+    text << in.rdbuf();
+    return in && out.parse(text.str());
 }
 
-// ---------- interactive input helpers ----------
-static bool askYesNo(const std::string& q, bool def) {
-    std::cout << q << (def ? " [Y/n]: " : " [y/N]: ");
-    std::string s;
-    std::getline(std::cin, s);
-    s = trim(s);
-    if (s.empty()) return def;
-    char c = (char)std::tolower((unsigned char)s[0]);
-    return c == 'y' || c == '1' || c == 't';
+static fs::path selfExecutable(const char* argv0) {
+#if defined(_WIN32)
+    wchar_t buf[32768];
+    const DWORD n = GetModuleFileNameW(nullptr, buf, 32768);
+    if (n > 0 && n < 32768) return fs::path(std::wstring(buf, n));
+#elif defined(__linux__)
+    std::error_code ec;
+    fs::path p = fs::read_symlink("/proc/self/exe", ec);
+    if (!ec) return p;
+#endif
+    return fs::absolute(argv0);
 }
 
-static long long askInt64(const std::string& q, long long def) {
-    std::cout << q << " (default " << def << "): ";
-    std::string s;
-    std::getline(std::cin, s);
-    s = trim(s);
-    if (s.empty()) return def;
-    try { return std::stoll(s); }
-    catch (...) { return def; }
+struct ChildRun {
+    int exitCode = -1;
+    double seconds = 0;
+    uint64_t peakRssKb = 0;
+};
+
+#ifdef _WIN32
+static std::wstring quoteWindowsArg(const std::wstring& a) {
+    if (!a.empty() && a.find_first_of(L" \t\"") == std::wstring::npos) return a;
+    std::wstring q = L"\"";
+    size_t slashes = 0;
+    for (wchar_t c : a) {
+        if (c == L'\\') { slashes++; continue; }
+        q.append(c == L'"' ? slashes * 2 + 1 : slashes, L'\\');
+        slashes = 0;
+        q += c;
+    }
+    q.append(slashes * 2, L'\\');
+    return q + L"\"";
 }
+#else
+extern char** environ;
+#endif
 
-static fs::path askPath() {
+// runs exe with args, standard output and error to log
+static bool runChild(const fs::path& exe, const std::vector<std::string>& args, const fs::path& log, ChildRun& run) {
+    const auto start = std::chrono::steady_clock::now();
 #ifdef _WIN32
-    // make console accept UTF-8 in many terminals
-    SetConsoleCP(CP_UTF8);
-    SetConsoleOutputCP(CP_UTF8);
+    std::wstring cmd = quoteWindowsArg(exe.wstring());
+    for (const auto& a : args) cmd += L" " + quoteWindowsArg(utf8ToWide(a));
+    SECURITY_ATTRIBUTES sa{ sizeof(sa), nullptr, TRUE };
+    HANDLE out = CreateFileW(log.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (out == INVALID_HANDLE_VALUE) return false;
+    STARTUPINFOW si{};
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput = out;
+    si.hStdError = out;
+    PROCESS_INFORMATION pi{};
+    const BOOL ok = CreateProcessW(nullptr, cmd.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi);
+    CloseHandle(out);
+    if (!ok) return false;
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    DWORD code = 1;
+    GetExitCodeProcess(pi.hProcess, &code);
+    run.exitCode = (int)code;
+    PROCESS_MEMORY_COUNTERS pmc{};
+    if (K32GetProcessMemoryInfo(pi.hProcess, &pmc, sizeof(pmc))) run.peakRssKb = pmc.PeakWorkingSetSize / 1024;
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return true;
+#else
+    std::vector<std::string> all{ exe.string() };
+    all.insert(all.end(), args.begin(), args.end());
+    std::vector<char*> argv;
+    for (auto& a : all) argv.push_back(a.data());
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&actions, 1, 2);
+    pid_t pid = 0;
+    const int err = posix_spawn(&pid, exe.c_str(), &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) return false;
+    int status = 0;
+    struct rusage ru {};
+    if (wait4(pid, &status, 0, &ru) != pid) return false;
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+#ifdef __APPLE__
+    run.peakRssKb = (uint64_t)ru.ru_maxrss / 1024; // bytes there
+#else
+    run.peakRssKb = (uint64_t)ru.ru_maxrss;
 #endif
-    std::cout << "Input file or folder path (you can paste / drag-drop):\n> ";
-    std::string in;
-    std::getline(std::cin, in);
-    in = trim(in);
+    return true;
+#endif
+}
 
-    // strip surrounding quotes
-    if (in.size() >= 2 && ((in.front() == '"' && in.back() == '"') || (in.front() == '\'' && in.back() == '\''))) {
-        in = in.substr(1, in.size() - 2);
+struct BenchOptions {
+    fs::path dir;
+    BenchTreeSpec tree;
+    std::vector<std::string> runs{ "plan", "report", "apply" };
+    fs::path outPath;                  // default DIR/bench.json
+    fs::path baselinePath;
+    double thresholdPercent = 10;      // slower than the baseline by more: regression
+    bool regenerate = false;
+    std::vector<int> jobs;             // scaling matrix: --jobs values (1, 2, 4, ... N)
+    std::vector<std::string> caches;   // scaling matrix: cold, warm
+    std::vector<std::string> forward;  // options for the runs
+};
+
+// the --bench* options; everything else is kept for the runs. -1: go on, else the exit code
+static int parseBenchOptions(const std::vector<std::string>& args, BenchOptions& b) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a.compare(0, 7, "--bench") != 0) {
+            b.forward.push_back(a);
+            continue;
+        }
+        if (a == "--bench-regenerate") { b.regenerate = true; continue; }
+        if (i + 1 >= args.size()) {
+            std::cout << "Missing value for " << a << "\n";
+            return 2;
+        }
+        const std::string& v = args[++i];
+        long long n = 0;
+        const bool numeric = a == "--bench-files" || a == "--bench-depth" || a == "--bench-fanout" || a == "--bench-seed"
+            || a == "--bench-exif" || a == "--bench-kb" || a == "--bench-threshold" || a == "--bench-scale";
+        if (numeric) {
+            try { n = std::stoll(v); }
+            catch (...) { n = -1; }
+            if (n < 0) {
+                std::cout << "Invalid number for " << a << ": " << v << "\n";
+                return 2;
+            }
+        }
+        if (a == "--bench") b.dir = pathFromUtf8(v);
+        else if (a == "--bench-files") b.tree.files = (uint64_t)std::max(1LL, n);
+        else if (a == "--bench-depth") b.tree.depth = (int)std::min(6LL, n);
+        else if (a == "--bench-fanout") b.tree.fanout = (int)std::clamp(n, 1LL, 99LL);
+        else if (a == "--bench-seed") b.tree.seed = (uint64_t)n;
+        else if (a == "--bench-exif") b.tree.exifPercent = (int)std::min(100LL, n);
+        else if (a == "--bench-kb") b.tree.fileKb = (int)std::min(65536LL, n);
+        else if (a == "--bench-threshold") b.thresholdPercent = (double)n;
+        else if (a == "--bench-scale") {
+            b.jobs.clear();
+            const int most = (int)std::clamp(n, 1LL, 256LL);
+            for (int j = 1; j < most; j *= 2) b.jobs.push_back(j);
+            b.jobs.push_back(most);
+        }
+        else if (a == "--bench-cache") {
+            b.caches.clear();
+            std::istringstream in(v);
+            for (std::string c; std::getline(in, c, ',');) {
+                if (c != "cold" && c != "warm") {
+                    std::cout << "Invalid value for --bench-cache (cold, warm): " << c << "\n";
+                    return 2;
+                }
+                b.caches.push_back(c);
+            }
+        }
+        else if (a == "--bench-out") b.outPath = pathFromUtf8(v);
+        else if (a == "--bench-baseline") b.baselinePath = pathFromUtf8(v);
+        else if (a == "--bench-formats" || a == "--bench-names") {
+            const bool formats = a == "--bench-formats";
+            const std::vector<std::string> known = formats ? kSyntheticKinds
+                : std::vector<std::string>{ "camera", "screenshot", "dashed", "plain" };
+            if (!parseBenchWeights(v, known, formats ? b.tree.formats : b.tree.names)) {
+                std::cout << "Invalid value for " << a << " (NAME=WEIGHT,... of " << BenchTreeSpec::weightsText(
+                    formats ? BenchTreeSpec().formats : BenchTreeSpec().names) << "): " << v << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--bench-runs") {
+            b.runs.clear();
+            std::istringstream in(v);
+            for (std::string r; std::getline(in, r, ',');) {
+                if (r != "plan" && r != "report" && r != "apply") {
+                    std::cout << "Invalid run for --bench-runs (plan, report, apply): " << r << "\n";
+                    return 2;
+                }
+                b.runs.push_back(r);
+            }
+        }
+        else {
+            std::cout << "Unknown option: " << a << "\n";
+            return 2;
+        }
+    }
+    if (b.dir.empty()) {
+        std::cout << "--bench needs a folder\n";
+        return 2;
+    }
+    if (b.outPath.empty()) b.outPath = b.dir / "bench.json";
+    if (!b.jobs.empty() && b.caches.empty()) b.caches = { "cold", "warm" };
+    return -1;
+}
+
+// Compares the runs in current with baseline (both bench.json numbers); prints a table, returns the regressions
+static int compareBench(const JsonNumbers& baseline, const JsonNumbers& current, const std::vector<std::string>& runs,
+    double thresholdPercent) {
+    int regressions = 0;
+    std::cout << "\nAgainst the baseline (regression: more than " << thresholdPercent << "% worse):\n";
+    auto row = [&](const std::string& label, const std::string& key, bool higherIsBetter, double minimum) {
+        const double was = baseline.get(key), now = current.get(key);
+        if (was < 0 || now < 0 || std::max(was, now) < minimum) return;
+        const double change = was > 0 ? (now - was) / was * 100 : 0;
+        const bool worse = (higherIsBetter ? -change : change) > thresholdPercent;
+        if (worse) regressions++;
+        std::cout << "  " << std::left << std::setw(34) << label << std::right << std::setw(12) << was << " -> "
+            << std::setw(12) << now << "  " << std::showpos << std::setw(7) << change << "%" << std::noshowpos
+            << (worse ? "  REGRESSION" : "") << "\n";
+        };
+    std::cout << std::fixed << std::setprecision(3);
+    for (const auto& r : runs) {
+        const std::string base = "runs." + r + ".";
+        row(r + " files/s", base + "files_per_second", true, 0);
+        row(r + " peak RSS KB", base + "peak_rss_kb", false, 0);
+        for (size_t k = 0; k < kStageCount; ++k) {
+            // stages under 50 ms are noise, not shown
+            row(r + " " + kStatStageNames[k] + " s", base + "stages." + kStatStageNames[k], false, 0.05);
+        }
     }
+    std::cout << std::defaultfloat << std::setprecision(6);
+    return regressions;
+}
 
+// Drops the tree's files from the page cache (written back first, dirty pages cannot be dropped); no root
+// needed. Not on Windows.
+static void evictFromPageCache(const fs::path& tree) {
 #ifdef _WIN32
-    // treat input as UTF-8
-    std::wstring w = utf8ToWide(in);
-    return fs::path(w);
+    (void)tree;
 #else
-    return fs::path(in);
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(tree, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file(ec)) continue;
+        const int fd = ::open(it->path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        ::close(fd);
+    }
+#endif
+}
+
+// Reads the tree's files once, so that they are in the page cache
+static void readIntoPageCache(const fs::path& tree) {
+    std::error_code ec;
+    std::vector<char> buf(1 << 20);
+    for (fs::recursive_directory_iterator it(tree, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file(ec)) continue;
+        std::ifstream in(it->path(), std::ios::binary);
+        while (in.read(buf.data(), (std::streamsize)buf.size())) {}
+    }
+}
+
+struct BenchRun {
+    std::string name;                  // plan, report, apply
+    std::string label;                 // name, with -j<jobs> and -<cache> in a scaling matrix
+    int jobs = 0;                      // 0: not set
+    std::string cache;                 // cold, warm or empty
+    double seconds = 0, files = 0;
+    double stages[kStageCount] = {};
+};
+
+// per run and cache state: wall time and each stage that matters against --jobs, with speedup and efficiency
+// against the fewest jobs. Only apply is swept (the dry runs do not use --jobs); the others are listed as not scaled.
+static void printScaling(const std::vector<BenchRun>& results, const std::vector<std::string>& runs,
+    const std::vector<std::string>& caches, std::ostringstream& json) {
+    json << ",\n  \"scaling\": {";
+    bool firstGroup = true;
+    std::string notScaled;
+    for (const auto& name : runs) {
+        if (name != "apply") {
+            notScaled += (notScaled.empty() ? "" : ", ") + name;
+            continue;
+        }
+        for (const auto& cache : caches) {
+            std::vector<const BenchRun*> group;
+            for (const auto& r : results) if (r.name == name && r.cache == cache) group.push_back(&r);
+            if (group.empty()) continue;
+            const BenchRun& base = *group.front();
+            std::cout << "\n" << name << (cache.empty() ? "" : ", " + cache + " cache") << " (seconds, speedup, efficiency)\n"
+                << std::left << std::setw(18) << "" << std::right;
+            for (const BenchRun* r : group) std::cout << std::setw(22) << std::to_string(r->jobs) + (r->jobs == 1 ? " job" : " jobs");
+            std::cout << "\n";
+            json << (firstGroup ? "" : ",") << "\n    \"" << name << (cache.empty() ? "" : "-" + cache) << "\": {";
+            firstGroup = false;
+            bool firstRow = true;
+            auto row = [&](const std::string& label, auto seconds) {
+                std::cout << std::left << std::setw(18) << label << std::right;
+                json << (firstRow ? "" : ",") << "\n      \"" << label << "\": {";
+                firstRow = false;
+                for (size_t k = 0; k < group.size(); ++k) {
+                    const double s = seconds(*group[k]), speedup = s > 0 ? seconds(base) / s : 0;
+                    const double efficiency = speedup * base.jobs / group[k]->jobs;
+                    char cell[64];
+                    std::snprintf(cell, sizeof(cell), "%8.2f %5.2fx %4.0f%%", s, speedup, efficiency * 100);
+                    std::cout << std::setw(22) << cell;
+                    json << (k ? ", " : " ") << "\"" << group[k]->jobs << "\": { \"seconds\": " << s << ", \"speedup\": "
+                        << speedup << ", \"efficiency\": " << efficiency << " }";
+                }
+                std::cout << "\n";
+                json << " }";
+                };
+            row("wall", [](const BenchRun& r) { return r.seconds; });
+            for (size_t k = 0; k < kStageCount; ++k) {
+                // stages under 50 ms or 5% of the run are noise
+                if (base.stages[k] < 0.05 || base.stages[k] < 0.05 * base.seconds) continue;
+                row(kStatStageNames[k], [k](const BenchRun& r) { return r.stages[k]; });
+            }
+            json << "\n    }";
+        }
+    }
+    json << "\n  }";
+    if (!notScaled.empty()) std::cout << "\nNot scaled (--jobs affects only apply, run once): " << notScaled << "\n";
+}
+
+static int runBenchmark(const std::vector<std::string>& args, const char* argv0) {
+    BenchOptions b;
+    const int rc = parseBenchOptions(args, b);
+    if (rc >= 0) return rc;
+    std::error_code ec;
+    const fs::path tree = b.dir / "tree", manifest = b.dir / "tree.params";
+    const std::string spec = b.tree.text();
+#ifdef _WIN32
+    if (std::find(b.caches.begin(), b.caches.end(), "cold") != b.caches.end()) {
+        std::cout << "Cold cache runs are not supported on Windows (no posix_fadvise); running warm only.\n";
+        b.caches.erase(std::find(b.caches.begin(), b.caches.end(), "cold"));
+    }
+#endif
+
+    // reuse the tree only while it is exactly as generated (an apply run changes it)
+    double generateSeconds = -1;
+    auto ensureTree = [&](bool force) {
+        std::string existing;
+        {
+            std::ifstream in(manifest);
+            std::getline(in, existing);
+        }
+        if (!force && existing == spec && fs::is_directory(tree, ec)) {
+            if (generateSeconds < 0) {
+                std::cout << "Reusing the tree in " << tree << "\n";
+                generateSeconds = 0;
+            }
+            return true;
+        }
+        std::cout << "Generating " << b.tree.files << " files in " << tree << " (" << spec << ")...\n";
+        fs::remove(manifest, ec);
+        fs::remove_all(tree, ec);
+        const auto start = std::chrono::steady_clock::now();
+        if (!generateBenchTree(tree, b.tree)) {
+            std::cout << "Cannot generate the tree in " << tree << "\n";
+            return false;
+        }
+        if (generateSeconds < 0) generateSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::ofstream(manifest) << spec << "\n";
+        return true;
+        };
+    if (!ensureTree(b.regenerate)) return 1;
+
+    const fs::path exe = selfExecutable(argv0);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6);
+    out << "{\n  \"tree\": { \"spec\": ";
+    std::string quoted;
+    appendJsonString(quoted, spec);
+    out << quoted << ", \"files\": " << b.tree.files << ", \"generate_seconds\": " << generateSeconds << " },\n  \"runs\": {";
+    std::cout << std::fixed << std::setprecision(2);
+    const std::vector<int> jobsList = b.jobs.empty() ? std::vector<int>{ 0 } : b.jobs;
+    const std::vector<std::string> caches = b.caches.empty() ? std::vector<std::string>{ "" } : b.caches;
+    std::vector<BenchRun> results;
+    for (const auto& name : b.runs) {
+        // --jobs sets the apply workers only; repeating the dry runs with it would just measure noise
+        const std::vector<int> runJobs = name == "apply" ? jobsList : std::vector<int>{ 0 };
+        for (const auto& cache : caches) {
+            for (int jobs : runJobs) {
+                BenchRun result;
+                result.name = name;
+                result.jobs = jobs;
+                result.cache = cache;
+                result.label = name + (jobs ? "-j" + std::to_string(jobs) : "") + (cache.empty() ? "" : "-" + cache);
+                const fs::path stats = b.dir / (result.label + ".stats.json"), log = b.dir / (result.label + ".log");
+                const fs::path report = b.dir / "report.jsonl";
+                std::vector<std::string> childArgs{ pathToUtf8(tree) };
+                childArgs.insert(childArgs.end(), b.forward.begin(), b.forward.end());
+                for (const char* a : { "--no-progress", "--report", "none", "--stats" }) childArgs.push_back(a);
+                childArgs.push_back(pathToUtf8(stats));
+                if (name == "report") for (const std::string& a : { std::string("--report"), std::string("jsonl"), std::string("--report-file"), pathToUtf8(report) }) childArgs.push_back(a);
+                if (jobs) for (const std::string& a : { std::string("--jobs"), std::to_string(jobs) }) childArgs.push_back(a);
+                // warm: the run must not drop what it reads either
+                if (cache == "warm") childArgs.push_back("--keep-page-cache");
+                if (!ensureTree(false)) return 1;
+                if (name == "apply") {
+                    childArgs.push_back("--apply");
+                    fs::remove(manifest, ec);
+                }
+                if (cache == "cold") evictFromPageCache(tree);
+                if (cache == "warm") readIntoPageCache(tree);
+                fs::remove(stats, ec);
+
+                ChildRun run;
+                JsonNumbers numbers;
+                if (!runChild(exe, childArgs, log, run) || run.exitCode != 0 || !readJsonNumbers(stats, numbers)) {
+                    std::cout << "Run " << result.label << " failed (exit code " << run.exitCode << "), see " << log << "\n";
+                    return 1;
+                }
+                result.seconds = run.seconds;
+                result.files = numbers.get("files", 0);
+                for (size_t k = 0; k < kStageCount; ++k) {
+                    result.stages[k] = std::max(0.0, numbers.get(std::string("stages.") + kStatStageNames[k] + ".seconds", 0));
+                }
+                const double filesPerSecond = run.seconds > 0 ? result.files / run.seconds : 0;
+                out << (results.empty() ? "" : ",") << "\n    \"" << result.label << "\": { \"wall_seconds\": " << run.seconds
+                    << ", \"files\": " << (uint64_t)result.files << ", \"files_per_second\": " << filesPerSecond
+                    << ", \"peak_rss_kb\": " << run.peakRssKb;
+                if (jobs) out << ", \"jobs\": " << jobs;
+                if (!cache.empty()) out << ", \"cache\": \"" << cache << "\"";
+                std::cout << std::left << std::setw(16) << result.label << std::right << std::setw(10) << run.seconds << " s  "
+                    << std::setw(12) << filesPerSecond << " files/s  peak RSS " << run.peakRssKb / 1024.0 << " MB";
+                if (name == "report") {
+                    // the report is all the dry-run apply stage does
+                    const double bytes = (double)fs::file_size(report, ec), seconds = numbers.get("stages.apply.seconds", 0);
+                    out << ", \"report_bytes\": " << (ec ? 0 : (uint64_t)bytes) << ", \"report_mb_per_second\": "
+                        << (seconds > 0 && !ec ? bytes / 1e6 / seconds : 0);
+                    if (seconds > 0 && !ec) std::cout << "  report " << bytes / 1e6 / seconds << " MB/s";
+                }
+                std::cout << "\n";
+                out << ", \"stages\": {";
+                for (size_t k = 0; k < kStageCount; ++k) out << (k ? ", " : " ") << "\"" << kStatStageNames[k] << "\": " << result.stages[k];
+                out << " } }";
+                results.push_back(std::move(result));
+            }
+        }
+    }
+    out << "\n  }";
+    if (!b.jobs.empty()) printScaling(results, b.runs, caches, out);
+    out << "\n}\n";
+    std::cout << std::defaultfloat << std::setprecision(6);
+
+    {
+        std::ofstream f(b.outPath, std::ios::binary | std::ios::trunc);
+        if (!(f << out.str() && f.flush())) {
+            std::cout << "Cannot write " << b.outPath << "\n";
+            return 1;
+        }
+    }
+    std::cout << "Results: " << b.outPath << "\n";
+    if (b.baselinePath.empty()) return 0;
+    JsonNumbers baseline, current;
+    if (!readJsonNumbers(b.baselinePath, baseline)) {
+        std::cout << "Cannot read the baseline " << b.baselinePath << "\n";
+        return 1;
+    }
+    current.parse(out.str());
+    if (baseline.get("tree.files") != current.get("tree.files")) std::cout << "Note: the baseline ran on a different tree size.\n";
+    std::vector<std::string> labels;
+    for (const auto& r : results) labels.push_back(r.label);
+    const int regressions = compareBench(baseline, current, labels, b.thresholdPercent);
+    std::cout << (regressions ? std::to_string(regressions) + " regression(s).\n" : "No regressions.\n");
+    return regressions ? 3 : 0;
+}
+
+// ---------- microbenchmarks (--microbench) ----------
+// photo_timefix --microbench [--micro-threads N] [--micro-seconds S] [--micro-filter TEXT] [--micro-out FILE]
+// Times the per-file time and filename helpers on a generated, real-world-shaped input set (camera, phone,
+// messenger and plain names with mixed extension case; EXIF, ISO and broken date strings), with 1 thread and
+// with N threads at once: locks in the C library time functions (mktime, localtime) show up as a lower
+// efficiency, allocations as allocs/op (counted unless built with PHOTO_TIMEFIX_NO_STATS).
+
+struct MicroInputs {
+    std::vector<fs::path> paths;
+    std::vector<std::string> dates;
+    std::vector<std::tm> tms;
+    std::vector<std::time_t> times;
+
+    explicit MicroInputs(size_t n) {
+        SplitMix64 rng(7);
+        const char* extensions[] = { ".jpg", ".JPG", ".jpeg", ".heic", ".HEIC", ".png", ".mp4", ".MOV", ".dng", ".mkv",
+            ".xmp", ".json", ".txt", "" };
+        for (size_t i = 0; i < n; ++i) {
+            const std::time_t t = 946684800 + (std::time_t)rng.below(25ULL * 365 * 86400);
+            times.push_back(t);
+            std::string name;
+            switch (rng.below(8)) {
+            case 0: name = syntheticFileName("camera", t, i, rng); break;
+            case 1: name = syntheticFileName("screenshot", t, i, rng); break;
+            case 2: name = syntheticFileName("dashed", t, i, rng); break;
+            case 3: name = localTimeText(t, "PXL_%Y%m%d_%H%M%S") + std::to_string(rng.below(1000)); break;
+            case 4: name = localTimeText(t, "WhatsApp Image %Y-%m-%d at %H.%M.%S"); break;
+            case 5: name = "DSC" + std::to_string(10000 + rng.below(90000)); break;
+            case 6: name = localTimeText(t, "VID_%Y%m%d_%H%M%S"); break;
+            default: name = syntheticFileName("plain", t, i, rng); break;
+            }
+            paths.push_back(fs::path("/photos") / localTimeText(t, "%Y") / localTimeText(t, "%m")
+                / (name + extensions[rng.below(sizeof(extensions) / sizeof(extensions[0]))]));
+
+            std::string date = toExifString(t);
+            switch (rng.below(8)) {
+            case 0: date = localTimeText(t, "%Y-%m-%dT%H:%M:%S"); break;
+            case 1: date = localTimeText(t, "%Y-%m-%dT%H:%M:%S.123+02:00"); break;
+            case 2: date += "Z"; break;
+            case 3: date = "  " + date + " "; break;
+            case 4: date = rng.chance(50) ? "0000:00:00 00:00:00" : "    :  :     :  :  "; break;
+            default: break;
+            }
+            dates.push_back(date);
+            if (auto tm = parseDateTimeToTm(toExifString(t))) tms.push_back(*tm);
+        }
+    }
+};
+
+struct MicroBenchmark {
+    const char* name;
+    std::function<uint64_t(size_t)> op; // input index -> something to keep the result alive
+};
+
+static std::atomic<uint64_t> microSink{ 0 }; // the results, so the calls are not optimized away
+
+struct MicroResult {
+    double nsPerOp = 0;     // per thread
+    double opsPerSecond = 0; // all threads
+    double allocsPerOp = -1;
+};
+
+// runs op on threads threads at once for about seconds
+static MicroResult runMicroBenchmark(const MicroBenchmark& b, size_t inputs, int threads, double seconds) {
+    std::atomic<int> ready{ 0 };
+    std::atomic<bool> go{ false };
+    std::atomic<uint64_t> totalOps{ 0 }, totalAllocs{ 0 };
+    std::vector<std::thread> pool;
+    std::chrono::steady_clock::time_point start;
+    for (int t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            ready++;
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+#ifndef PHOTO_TIMEFIX_NO_STATS
+            const uint64_t allocsBefore = tlsStats[kStatAllocations];
+#endif
+            const auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+            uint64_t ops = 0, keep = 0;
+            size_t i = (size_t)t * 997 % inputs; // threads start at different inputs
+            do {
+                for (int k = 0; k < 64; ++k, ++ops) {
+                    keep += b.op(i);
+                    if (++i == inputs) i = 0;
+                }
+            } while (std::chrono::steady_clock::now() < end);
+#ifndef PHOTO_TIMEFIX_NO_STATS
+            totalAllocs += tlsStats[kStatAllocations] - allocsBefore;
+#endif
+            totalOps += ops;
+            microSink += keep;
+            mergeThreadStats();
+            });
+    }
+    while (ready.load() < threads) std::this_thread::yield();
+    start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& th : pool) th.join();
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    MicroResult r;
+    const double ops = (double)std::max<uint64_t>(1, totalOps.load());
+    r.opsPerSecond = ops / elapsed;
+    r.nsPerOp = elapsed * 1e9 * threads / ops;
+#ifndef PHOTO_TIMEFIX_NO_STATS
+    r.allocsPerOp = (double)totalAllocs.load() / ops;
 #endif
+    return r;
+}
+
+static int runMicrobench(const std::vector<std::string>& args) {
+    int threads = (int)std::max(2u, std::thread::hardware_concurrency());
+    double seconds = 0.5;
+    std::string filter;
+    fs::path outPath;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a == "--microbench") continue;
+        if (i + 1 >= args.size()) {
+            std::cout << "Missing value for " << a << "\n";
+            return 2;
+        }
+        const std::string& v = args[++i];
+        if (a == "--micro-threads" || a == "--micro-seconds") {
+            double n = -1;
+            try { n = std::stod(v); }
+            catch (...) {}
+            if (n <= 0) {
+                std::cout << "Invalid number for " << a << ": " << v << "\n";
+                return 2;
+            }
+            if (a == "--micro-threads") threads = (int)std::min(1024.0, n);
+            else seconds = n;
+        }
+        else if (a == "--micro-filter") filter = v;
+        else if (a == "--micro-out") outPath = pathFromUtf8(v);
+        else {
+            std::cout << "Unknown option: " << a << "\n";
+            return 2;
+        }
+    }
+
+    const MicroInputs in(4096);
+    const std::vector<MicroBenchmark> benchmarks{
+        { "parseFilenameTime", [&](size_t i) { auto t = parseFilenameTime(in.paths[i]); return t ? (uint64_t)*t : 0; } },
+        { "parseDateTimeToTm", [&](size_t i) { auto tm = parseDateTimeToTm(in.dates[i]); return tm ? (uint64_t)tm->tm_sec : 0; } },
+        { "normalizeDate", [&](size_t i) { return (uint64_t)normalizeDate(in.dates[i]).size(); } },
+        { "tmToTimeTLocal", [&](size_t i) { auto t = tmToTimeTLocal(in.tms[i % in.tms.size()]); return t ? (uint64_t)*t : 0; } },
+        { "plausible", [&](size_t i) { return (uint64_t)plausible(in.times[i]); } },
+        { "formatLocalTime", [&](size_t i) { return (uint64_t)formatLocalTime(in.times[i]).size(); } },
+        { "hasMediaExt", [&](size_t i) { return (uint64_t)hasMediaExt(in.paths[i]); } },
+    };
+
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3) << "{\n  \"threads\": " << threads << ",\n  \"benchmarks\": {";
+    std::cout << "Inputs: " << in.paths.size() << " paths and date strings; " << threads << " threads, " << seconds << " s per run\n\n";
+    std::cout << std::left << std::setw(20) << "function" << std::right << std::setw(12) << "ns/op 1T" << std::setw(11) << "allocs/op"
+        << std::setw(12) << "ns/op " + std::to_string(threads) + "T" << std::setw(14) << "Mops/s " + std::to_string(threads) + "T"
+        << std::setw(9) << "speedup" << std::setw(12) << "efficiency" << "\n";
+    bool first = true;
+    for (const auto& b : benchmarks) {
+        if (!filter.empty() && std::string(b.name).find(filter) == std::string::npos) continue;
+        const MicroResult one = runMicroBenchmark(b, in.paths.size(), 1, seconds);
+        const MicroResult many = runMicroBenchmark(b, in.paths.size(), threads, seconds);
+        const double speedup = many.opsPerSecond / one.opsPerSecond;
+        std::cout << std::fixed << std::setprecision(1) << std::left << std::setw(20) << b.name << std::right
+            << std::setw(12) << one.nsPerOp << std::setw(11);
+        if (one.allocsPerOp >= 0) std::cout << one.allocsPerOp; else std::cout << "-";
+        std::cout << std::setw(12) << many.nsPerOp << std::setw(14) << std::setprecision(2) << many.opsPerSecond / 1e6
+            << std::setw(9) << speedup << std::setw(11) << std::setprecision(0) << speedup / threads * 100 << "%\n";
+        json << (first ? "" : ",") << "\n    \"" << b.name << "\": { \"ns_per_op\": " << one.nsPerOp << ", \"allocs_per_op\": ";
+        if (one.allocsPerOp >= 0) json << one.allocsPerOp; else json << "null";
+        json << ", \"threaded_ns_per_op\": " << many.nsPerOp << ", \"threaded_ops_per_second\": "
+            << many.opsPerSecond << ", \"speedup\": " << speedup << ", \"efficiency\": " << speedup / threads << " }";
+        first = false;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
+    json << "\n  }\n}\n";
+    if (!outPath.empty()) {
+        std::ofstream f(outPath, std::ios::binary | std::ios::trunc);
+        if (!(f << json.str() && f.flush())) {
+            std::cout << "Cannot write " << outPath << "\n";
+            return 1;
+        }
+        std::cout << "Results: " << outPath << "\n";
+    }
+    return 0;
 }
 
 // ---------- main ----------
 int main(int argc, char** argv) {
+    const auto start = std::chrono::steady_clock::now();
     Options opt;
+    fs::path root;
 
     std::cout << "Photo Time Fix (mtime-sort + EXIF read + interpolate missing)\n";
-    std::cout << "Tips: first run with dry-run = yes.\n\n";
 
-    fs::path root = askPath();
+    const std::vector<std::string> args = commandLineArgs(argc, argv);
+    const bool batch = !args.empty();
+    if (batch && std::find(args.begin(), args.end(), "--bench") != args.end()) return runBenchmark(args, argv[0]);
+    if (batch && args[0].compare(0, 8, "--corpus") == 0) return runCorpus(args);
+    if (batch && args[0] == "--microbench") return runMicrobench(args);
+    if (batch) {
+        int rc = parseCommandLine(args, opt, root);
+        if (rc >= 0) return rc;
+        if (!opt.queryFile.empty()) return runIndexQuery(root, opt);
+        if (!opt.rollbackPath.empty()) return runRollback(opt);
+        if (!opt.statsPath.empty()) enableHardwareCounters();
+        if (!opt.tracePath.empty()) {
+            tracer().enable();
+            traceThreadName("main");
+        }
+        if (!setThreadIoPriority(opt)) std::cout << "Warning: cannot set the I/O priority.\n";
+        if (!opt.applyPlanPath.empty()) return runPlanApply(opt);
+    }
+    else {
+        std::cout << "Tips: first run with dry-run = yes.\n\n";
+        root = askPath();
+    }
 
     if (root.empty()) {
         std::cout << "No path provided.\n";
@@ -731,153 +6374,255 @@ int main(int argc, char** argv) {
     }
 
     // interactive options
-    opt.recursive = askYesNo("Recursive scan?", true);
-    opt.dryRun = askYesNo("Dry-run (no changes)?", true);
+    if (!batch) {
+        opt.recursive = askYesNo("Recursive scan?", true);
+        opt.dryRun = askYesNo("Dry-run (no changes)?", true);
 
-    opt.enableFilenameFallbackForShot = askYesNo("If EXIF missing, allow filename timestamp as shot time (anchor)?", true);
-    opt.enableFilenameOverrideForTarget = askYesNo("If fs times drift too far from filename timestamp, override target by filename?", true);
+        opt.enableFilenameFallbackForShot = askYesNo("If EXIF missing, allow filename timestamp as shot time (anchor)?", true);
+        opt.enableFilenameOverrideForTarget = askYesNo("If fs times drift too far from filename timestamp, override target by filename?", true);
 
-    opt.filenameOverrideDays = askInt64("Filename override threshold days", 7);
-    opt.anchorGapLimitDays = askInt64("Anchor gap limit days (too large -> no interpolation)", 90);
+        opt.filenameOverrideDays = askInt64("Filename override threshold days", 7);
+        opt.anchorGapLimitDays = askInt64("Anchor gap limit days (too large -> no interpolation)", 90);
 
-    opt.oneSideStep = askYesNo("When only one anchor exists, apply +1s steps to avoid same timestamp?", true);
+        opt.oneSideStep = askYesNo("When only one anchor exists, apply +1s steps to avoid same timestamp?", true);
 
-    opt.writeExifIfMissing = askYesNo("Write EXIF shot time if missing (DateTimeOriginal/Digitized/Image.DateTime)?", true);
-    opt.syncFileTimes = askYesNo("Sync filesystem times to target time?", true);
+        opt.writeExifIfMissing = askYesNo("Write EXIF shot time if missing (DateTimeOriginal/Digitized/Image.DateTime)?", true);
+        opt.syncFileTimes = askYesNo("Sync filesystem times to target time?", true);
+    }
 
     std::cout << "\nScanning...\n";
 
-    std::vector<Item> items;
-    collectFiles(root, opt.recursive, items);
+    Progress progress;
+    ProgressReporter progressReporter(progress, opt.progress, opt.progressJsonEvery);
+    ItemTable items;
+    {
+        StageTimer timer(kStageCollect);
+        collectFiles(root, opt.recursive, items, progress.counter(Stage::Scan));
+        items.shrinkToFit();
+    }
 
-    if (items.empty()) {
+    if (items.size() == 0) {
         std::cout << "No image files found.\n";
         return 0;
     }
 
+    // previous run's index: shots of unchanged files and plans of unchanged segments
+    const bool useIndex = !opt.indexPath.empty() && fs::is_directory(root, ec);
+    AnchorIndexView prevIndex;
+    bool incremental = false;
+    if (opt.incremental && useIndex) {
+        incremental = prevIndex.open(opt.indexPath) && prevIndex.sameOptions(opt) && prevIndex.root == absoluteUtf8(root);
+        if (!incremental) {
+            prevIndex.close();
+            std::cout << "Incremental: no matching previous index, planning everything.\n";
+        }
+    }
+    if (incremental) items.indexRecord.assign(items.size(), -1);
+
     // fill shot time for each item
-    int anchors = 0;
-    for (auto& it : items) {
-        fillShotTime(it, opt);
-        if (it.shot) anchors++;
+    const IndexNames names{ items, pathToUtf8(root) };
+    KeptMetadata kept;
+    if (!opt.dryRun && opt.writeExifIfMissing && !opt.xmpSidecar) kept.limit = opt.keepMetadata;
+    IoThrottle throttle(opt);
+    PageCacheStats pageCache;
+    std::unique_ptr<LatencyStats> latency;
+    if (!opt.statsPath.empty()) {
+        latency = std::make_unique<LatencyStats>(opt.slowestFiles);
+        items.readSeconds.assign(items.size(), 0);
+    }
+    int anchors = 0, reusedShots = 0;
+    progress.enter(Stage::Read, items.size());
+    StageTimer readTimer(kStageReadShot);
+    TraceSpan readBatch;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (i % kReadTraceBatch == 0) readBatch.begin("read batch", "first row", i);
+        if (incremental && reuseShotFromIndex(prevIndex, names(i), items, i)) {
+            reusedShots++;
+        }
+        else {
+            throttle.run([&] {
+                const auto start = std::chrono::steady_clock::now();
+                fillShotTime(items, i, opt, &kept, &pageCache);
+                if (latency) {
+                    items.readSeconds[i] = (float)std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    latency->record(kLatencyRead, items, i, latency->readDevice(items, i), items.readSeconds[i]);
+                }
+                });
+        }
+        if (items.hasShot(i)) anchors++;
+        progress.add(Stage::Read);
     }
+    readBatch.end();
+    readTimer.stop();
 
     // sort by mtime (and path as tie-breaker)
-    std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
-        if (a.mtime != b.mtime) return a.mtime < b.mtime;
-        return a.path.u8string() < b.path.u8string();
-        });
-
-    // pre-apply filename override for target (this can set target even if shot exists)
-    if (opt.enableFilenameOverrideForTarget) {
-        for (auto& it : items) applyFilenameOverrideForTarget(it, opt);
+    progress.enter(Stage::Plan, items.size());
+    {
+        StageTimer timer(kStageSort);
+        std::vector<uint32_t> order(items.size());
+        for (uint32_t i = 0; i < (uint32_t)order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            if (items.mtime[a] != items.mtime[b]) return items.mtime[a] < items.mtime[b];
+            return items.paths.compare(items.pathId[a], items.pathId[b]) < 0;
+            });
+        items.permute(order);
     }
 
-    // For files that already have shot time and don't have a target yet, set target = shot
-    for (auto& it : items) {
-        if (!it.target && it.shot) {
-            it.target = it.shot;
-            it.targetReason = (it.shotSource == ShotSource::Filename) ? "shot from filename" : "shot from metadata";
-        }
+    if (incremental) {
+        StageTimer overrideTimer(kStageOverride);
+        setShotAndOverrideTargets(items, opt);
+        overrideTimer.stop();
+        StageTimer interpolateTimer(kStageInterpolate);
+        ReplanStats rs = replanChangedSegments(items, names, prevIndex, opt);
+        interpolateTimer.stop();
+        StageTimer dedupTimer(kStageDedup);
+        makeTargetsUnique(items, opt);
+        dedupTimer.stop();
+        std::cout << "Incremental: " << reusedShots << " unchanged files, re-planned " << rs.replanned
+            << " of " << rs.segments << " segments\n";
+    }
+    else {
+        planTargets(items, opt);
     }
+    progress.add(Stage::Plan, items.size());
 
-    // interpolate only for files that have NO shot (missing) AND target not set by filename override
-    inferMissingByInterpolation(items, opt);
-    // 新增：把所有 [FILL] 的 target 做 +1s/+2s 去重兜底
-    makeFilledTargetsStrictlyIncreasing(items, opt);
     // apply changes
-    int changedExif = 0, changedFs = 0;
-    int filledCount = 0, skippedNoTarget = 0;
+    int changedExif = 0, changedXmp = 0, changedFs = 0, matchedFs = 0;
+    int filledCount = 0, skippedNoTarget = 0, skippedApplied = 0;
     int processed = 0;
 
     std::cout << "\nFiles: " << items.size() << ", anchors(with shot): " << anchors << "\n";
-    std::cout << "----\n";
 
-    for (auto& it : items) {
+    // the writes run in the background, per device (ParallelApply); the report below stays in timeline order
+    StageTimer applyTimer(kStageApply);
+    std::vector<uint32_t> toApply;
+    if (!opt.dryRun) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (items.hasTarget(i) && previousAppliedTarget(items, i, prevIndex) != items.target[i]) toApply.push_back((uint32_t)i);
+        }
+        if (!toApply.empty()) Exiv2::XmpParser::initialize(); // not thread-safe, do it before the workers start
+        progress.enter(Stage::Apply, toApply.size());
+    }
+    ApplyJournal journal;
+    const bool journaling = !opt.journalPath.empty() && !toApply.empty();
+    if (journaling && !journal.create(opt.journalPath, opt.journalSyncEvery)) {
+        std::cout << "Cannot create the journal: " << opt.journalPath << "\n";
+        return 1;
+    }
+    ParallelApply apply(items, toApply, opt, kept, journaling ? &journal : nullptr, throttle, latency.get());
+    size_t nextApply = 0;
+    ReportWriter report(opt.reportFormat, opt.reportPath, opt.verbose);
+
+    for (size_t i = 0; i < items.size(); ++i) {
         processed++;
 
-        bool missingShot = !it.shot.has_value(); // metadata+filename anchor both missing
+        bool missingShot = !items.hasShot(i); // metadata+filename anchor both missing
         // But in our design, "missingShot" means no shot extracted; still may have target via interpolation/override.
 
-        if (!it.target) {
+        if (!items.hasTarget(i)) {
             skippedNoTarget++;
-            if (opt.verbose) {
-                std::cout << "[SKIP] " << it.path << " (no target time inferred)\n";
-            }
+            report.file(items, i, ReportAction::NoTarget);
             continue;
         }
 
         // count filled: originally no shot time AND now has target
-        if (!it.shot && it.target) filledCount++;
+        if (!items.hasShot(i)) filledCount++;
 
-        std::cout << (it.shot ? "[OK]   " : "[FILL] ")
-            << it.path << "\n"
-            << "       target: " << formatLocalTime(*it.target)
-            << "   (" << it.targetReason << ")\n"
-            << "       mtime : " << formatLocalTime(it.mtime) << "\n";
-
-#ifdef _WIN32
-        if (it.ctime && it.wtime) {
-            std::cout << "       ctime : " << formatLocalTime(*it.ctime) << "\n";
-            std::cout << "       wtime : " << formatLocalTime(*it.wtime) << "\n";
+        // unchanged since a run that already applied this target: nothing to touch
+        if (previousAppliedTarget(items, i, prevIndex) == items.target[i]) {
+            skippedApplied++;
+            report.file(items, i, ReportAction::Unchanged);
+            continue;
         }
-#endif
 
         if (opt.dryRun) {
-            std::cout << "       dry-run: no changes\n";
-            std::cout << "----\n";
+            report.file(items, i, ReportAction::DryRun);
             continue;
         }
 
-        // 1) write EXIF only if missing shot in metadata (safer: only write when metadata had no usable shot)
-        // Here "missingShot" might be true even if filename used as shot anchor earlier. We prefer to detect metadata-missing:
-        bool metadataHadShot = (it.shotSource == ShotSource::ExifOrXmp);
-        bool shouldWriteExif = opt.writeExifIfMissing && !metadataHadShot; // only if metadata didn't already provide shot
-
-        if (shouldWriteExif) {
-            if (writeExifShotIfMissing(it.path, *it.target, opt.verbose)) {
-                changedExif++;
-                std::cout << "       EXIF: written (missing keys)\n";
-            }
-            else {
-                std::cout << "       EXIF: not written (maybe unsupported format or already present)\n";
-            }
-        }
-
-        // 2) sync file system times
-        if (opt.syncFileTimes) {
-#ifdef _WIN32
-            if (setFileTimesWindows(it.path, *it.target, opt.verbose)) {
-                changedFs++;
-                std::cout << "       FS  : times updated\n";
-            }
-            else {
-                std::cout << "       FS  : update failed\n";
-            }
-#else
-            if (setFileTimesPosix(it.path, *it.target, opt.verbose)) {
-                changedFs++;
-                std::cout << "       FS  : times updated\n";
-            }
-            else {
-                std::cout << "       FS  : update failed\n";
-            }
-#endif
-        }
-
-        std::cout << "----\n";
+        uint8_t applied = 0;
+        const std::string log = apply.wait(nextApply++, applied);
+        items.flags[i] |= applied;
+        if (items.flags[i] & kExifWritten) changedExif++;
+        if (items.flags[i] & kXmpWritten) changedXmp++;
+        if (items.flags[i] & kFsTimesSynced) changedFs++;
+        if (items.flags[i] & kFsTimesMatched) matchedFs++;
+        report.file(items, i, ReportAction::Applied, applied, log);
+        progress.add(Stage::Apply);
     }
+    apply.finish();
+    report.close();
+    progressReporter.finish();
+    applyTimer.stop();
+    if (latency) latency->offerNotApplied(items, toApply);
 
     std::cout << "\nDone.\n";
     std::cout << "Filled missing (no shot -> inferred target): " << filledCount << "\n";
     std::cout << "No-target skipped: " << skippedNoTarget << "\n";
+    if (skippedApplied) std::cout << "Already applied (unchanged): " << skippedApplied << "\n";
     if (!opt.dryRun) {
-        std::cout << "EXIF updated (missing-only): " << changedExif << "\n";
+        if (opt.xmpSidecar) {
+            const size_t folders = changedXmp ? syncXmpSidecars(items) : 0;
+            std::cout << "XMP sidecars written (missing-only): " << changedXmp << " (synced " << folders << " folders)\n";
+        }
+        else {
+            std::cout << "EXIF updated (missing-only): " << changedExif << "\n";
+        }
         std::cout << "Filesystem times updated: " << changedFs << "\n";
+        if (matchedFs) std::cout << "Filesystem times already matching: " << matchedFs << "\n";
+        if (journaling) std::cout << "Journal: " << opt.journalPath << " (undo with --rollback)\n";
     }
     else {
         std::cout << "Dry-run mode: no changes made.\n";
     }
+    if (pageCache.files) {
+        const auto mb = [](uint64_t bytes) { return bytes / (1024.0 * 1024.0); };
+        std::cout << std::fixed << std::setprecision(1) << "Page cache: metadata reads of " << pageCache.files
+            << " files (" << pageCache.headerReads << " JPEG headers read directly) cached " << mb(pageCache.added)
+            << " MB, dropped " << mb(pageCache.dropped) << " MB again, " << mb(pageCache.added - pageCache.dropped)
+            << " MB left\n" << std::defaultfloat << std::setprecision(6);
+    }
+    if (throttle.active()) {
+        std::cout << "Throttled: waited " << std::fixed << std::setprecision(1) << throttle.waited << "s, caps at "
+            << std::setprecision(0) << throttle.scale * 100 << "%";
+        if (throttle.latencyTarget > 0) std::cout << ", " << std::setprecision(1) << throttle.latency * 1000 << "ms per file";
+        std::cout << std::defaultfloat << std::setprecision(6) << "\n";
+    }
+
+    StageTimer indexTimer(kStageIndex);
+    if (opt.dryRun && !opt.planPath.empty()) {
+        std::vector<uint32_t> rows;
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (items.hasTarget(i) && previousAppliedTarget(items, i, prevIndex) != items.target[i]) rows.push_back((uint32_t)i);
+        }
+        const fs::path planRoot = fs::is_directory(root, ec) ? root : root.parent_path();
+        if (writePlan(opt.planPath, absoluteUtf8(planRoot), IndexNames{ items, pathToUtf8(planRoot) }, rows, opt)) {
+            std::cout << "Plan written: " << opt.planPath << " (" << rows.size() << " files, apply with --apply-plan)\n";
+        }
+        else {
+            std::cout << "Plan write failed: " << opt.planPath << "\n";
+        }
+    }
+
+    if (useIndex) {
+        std::vector<AnchorIndexEntry> entries;
+        entries.reserve(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            const int64_t applied = (items.flags[i] & kTargetApplied) ? items.target[i]
+                : previousAppliedTarget(items, i, prevIndex);
+            entries.push_back(indexEntryAfterRun(items, i, names(i), applied));
+        }
+        prevIndex.close();
+        if (writeAnchorIndex(opt.indexPath, absoluteUtf8(root), std::move(entries), opt)) {
+            std::cout << "Anchor index written: " << opt.indexPath << "\n";
+        }
+        else {
+            std::cout << "Anchor index write failed: " << opt.indexPath << "\n";
+        }
+    }
+    indexTimer.stop();
 
+    saveRunStats(opt, items.size(), start, latency.get());
+    saveTrace(opt);
     return 0;
 }